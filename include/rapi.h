@@ -166,6 +166,14 @@ typedef struct {
 	int mapq_min;
 	int isize_min;
 	int isize_max;
+	int n_threads; /**< size of the worker pool created by rapi_aligner_state_init */
+	int pin_threads; /**< pin the pool's worker threads to the NUMA nodes, round robin (see RAPI_REF_LOAD_NUMA) */
+	int exact_fast_path; /**< reads matching the reference exactly and uniquely skip seeding and extension (paired-end only) */
+	int collapse_duplicates; /**< align identical fragments in a batch only once and copy the alignments */
+	size_t aln_cache_bytes; /**< size of the alignment cache kept by rapi_aligner_state_init (0 for none) */
+	size_t sa_cache_bytes;  /**< size of the aligner state's cache of the positions of repetitive seeds (0 for none) */
+	int sched_chunk;        /**< reads the worker threads take at a time (0 for the smallest unit) */
+	int sched_cost_order;   /**< align the fragments expected to be the most expensive first */
 	/* Mismatch / Gap_Opens / Quality Trims --> Generalize ? */
 
 	/* Aligner specific parameters in 'parameters' list.
@@ -233,23 +241,39 @@ typedef struct {
 
 /**
  * Reads
+ *
+ * If seq_packed is set, `seq` isn't text:  it holds the 2-bit codes of the
+ * bases (A=0, C=1, G=2, T=3), four per byte starting from the low-order
+ * bits, in (length + 3) / 4 bytes.  These are followed by an N mask of
+ * (length + 7) / 8 bytes where bit i is set if base i is an N.  Use
+ * rapi_read_base or rapi_read_get_seq to access packed sequences.
  */
 typedef struct {
 	char * id;   // NULL-terminated
-	char * seq;  // NULL-terminated, capital letters in [AGCTN]
-	char * qual; // NULL-terminated, ASCII-encoded in Sanger q+33 format
+	char * seq;  // letters in [AGCTN] (upper case unless set by rapi_set_read_ref).  NULL-terminated unless set by rapi_set_read_ref or packed
+	char * qual; // ASCII-encoded in Sanger q+33 format.  NULL-terminated unless set by rapi_set_read_ref
 	unsigned int length; // sequence length
 	rapi_alignment* alignments;
 	uint8_t n_alignments;
+	uint8_t seq_packed;
 } rapi_read;
 
 /**
  * Batches of reads
+ *
+ * All the strings and alignment data referenced by the reads in a batch
+ * (ids, sequences, qualities, alignments, CIGARs and tags) are carved out of
+ * a memory arena owned by the batch and released all at once by
+ * rapi_reads_free.  They must not be freed or reallocated individually.
  */
+typedef struct rapi_arena rapi_arena; //< opaque structure
+
 typedef struct {
 	int n_frags;
 	int n_reads_frag;
 	rapi_read * reads;
+	int packed; // pack the sequences set with rapi_set_read.  See rapi_reads_set_packed
+	rapi_arena * _arena;
 } rapi_batch;
 
 
@@ -267,10 +291,130 @@ int rapi_init(const rapi_opts* opts);
 const char* rapi_aligner_name();
 const char* rapi_aligner_version();
 
-/* Load reference */
+/*
+ * Load reference.
+ *
+ * Indices are shared within the process:  loading a reference that is
+ * already loaded (identified by its canonical path and file identity, so
+ * different paths to the same files count as one) fills in `ref_struct`
+ * with the same index, and the index is only dropped when the last
+ * rapi_ref using it is freed.
+ */
 int rapi_ref_load( const char * reference_path, rapi_ref * ref_struct );
 
-/* Free reference */
+/* Reference load flags */
+#define RAPI_REF_LOAD_HEAP      0x0  // read the index into private memory (what rapi_ref_load does)
+#define RAPI_REF_LOAD_MMAP      0x1  // map the index files read-only, sharing them through the page cache
+#define RAPI_REF_MMAP_POPULATE  0x2  // with RAPI_REF_LOAD_MMAP:  fault in the whole index at load time
+#define RAPI_REF_MMAP_HUGETLB   0x4  // with RAPI_REF_LOAD_MMAP:  use huge pages (files on hugetlbfs), else hint for transparent ones
+#define RAPI_REF_LOAD_METADATA  0x8  // only read the contig information;  the rest is loaded by the first rapi_align_reads
+#define RAPI_REF_LOAD_NUMA      0x10 // keep a copy of the index on every NUMA node (needs a build with NUMA=1)
+#define RAPI_REF_LOAD_HUGEPAGES 0x20 // read the index into memory on huge pages (see rapi_ref_get_page_stats)
+#define RAPI_REF_HUGEPAGES_1G   0x40 // with RAPI_REF_LOAD_HUGEPAGES:  try 1 GB pages before 2 MB ones
+
+/*
+ * Load reference, choosing how with a combination of RAPI_REF_* flags.
+ *
+ * With RAPI_REF_LOAD_MMAP the index is used directly from the files, so
+ * loading takes milliseconds once the files are in the page cache, and
+ * every process that maps the same index shares one copy of it.  The files
+ * must not be modified while the reference is loaded.
+ *
+ * With RAPI_REF_LOAD_NUMA, once loaded the index is copied to the memory of
+ * each of the other NUMA nodes, and the worker threads read the copy on
+ * their node.  Use it with rapi_opts.pin_threads, so that the workers stay
+ * on one node.  Without libnuma support the flag is ignored.
+ *
+ * With RAPI_REF_LOAD_HUGEPAGES the BWT, SA and packed reference are read
+ * into memory allocated on huge pages, to spare the TLB misses of random
+ * accesses over gigabytes.  The pages come from the kernel's hugetlb pool
+ * (vm.nr_hugepages) if it has enough free, else the memory is advised for
+ * transparent huge pages.  It doesn't apply to RAPI_REF_LOAD_MMAP, which
+ * has RAPI_REF_MMAP_HUGETLB.
+ */
+int rapi_ref_load_flags( const char * reference_path, int flags, rapi_ref * ref_struct );
+
+/*
+ * Load reference in the background.  This returns as soon as the contig
+ * information in ref_struct is available, while a thread loads the rest of
+ * the index.  rapi_align_reads waits for the load to complete, so reads can
+ * be prepared in the meantime.  rapi_ref_get_progress reports how far the
+ * load is and rapi_ref_wait blocks until it's done.
+ *
+ * With RAPI_REF_LOAD_MMAP, the "load" consists of faulting in the mapped
+ * files.
+ */
+int rapi_ref_load_async( const char * reference_path, int flags, rapi_ref * ref_struct );
+
+/* Bytes of one index component loaded so far, out of total */
+typedef struct {
+	uint64_t loaded;
+	uint64_t total;
+} rapi_load_progress;
+
+typedef struct {
+	rapi_load_progress bwt;
+	rapi_load_progress sa;
+	rapi_load_progress pac;
+	int ready; // set once the load has completed, successfully or not
+} rapi_ref_progress;
+
+int rapi_ref_get_progress( const rapi_ref * ref_struct, rapi_ref_progress * progress );
+
+/* Block until the reference is loaded.  Return the load's error code. */
+int rapi_ref_wait( const rapi_ref * ref_struct );
+
+/* Bytes of the BWT, SA and packed reference of a loaded index, by page size */
+typedef struct {
+	uint64_t total;
+	uint64_t hugetlb_1g; // on 1 GB pages from the hugetlb pool
+	uint64_t hugetlb_2m; // on 2 MB pages from the hugetlb pool
+	uint64_t thp;        // on transparent huge pages (an estimate)
+} rapi_ref_page_stats;
+
+/*
+ * Report which pages hold the index of a loaded reference, however it was
+ * loaded.  The rest of `total` is on normal pages (or not in memory at all).
+ * Reads /proc/self/smaps, so it's slow-ish and only works on Linux;
+ * elsewhere returns RAPI_OP_NOT_SUPPORTED_ERROR.
+ */
+int rapi_ref_get_page_stats( const rapi_ref * ref_struct, rapi_ref_page_stats * stats );
+
+/*
+ * Build an index for the reference in `fasta_path` (plain or gzipped),
+ * writing the index files (.bwt, .sa, .pac, .ann, .amb) with the names
+ * starting with out_prefix, like `bwa index -p out_prefix` does.  Fails
+ * with RAPI_GENERIC_ERROR if the files can't be written or the input holds
+ * no sequence.
+ *
+ * \param n_threads threads used to sample the suffix array, for references of
+ *                  at least a few Mbases.  BWT construction is single-threaded.
+ * \param mem_budget bytes available for BWT construction:  if the faster IS
+ *                   algorithm would need more, BWT-SW is used.  0 to choose
+ *                   as `bwa index` does, based on the reference length.
+ */
+int rapi_ref_build( const char * fasta_path, const char * out_prefix, int n_threads, size_t mem_budget );
+
+#define RAPI_REF_BUILD_SA_INTV 32 // suffix array sampling interval used by rapi_ref_build
+
+/*
+ * Like rapi_ref_build, sampling one suffix array entry every sa_intv.
+ * Larger intervals make the index smaller, but make locating alignments
+ * slower.  sa_intv must be a power of 2, or RAPI_PARAM_ERROR is returned.
+ * The occurrence-count interval of the .bwt is fixed when BWA is compiled.
+ */
+int rapi_ref_build_sampled( const char * fasta_path, const char * out_prefix, int n_threads, size_t mem_budget, int sa_intv );
+
+/*
+ * Save the loaded reference to a single snapshot file, which
+ * rapi_ref_load_snapshot can map and use as it is, with no parsing.
+ * Snapshots aren't portable across architectures.
+ */
+int rapi_ref_save_snapshot( const rapi_ref * ref_struct, const char * path );
+
+int rapi_ref_load_snapshot( const char * path, rapi_ref * ref_struct );
+
+/* Free reference (the index itself goes with the last rapi_ref that shares it) */
 int rapi_ref_free( rapi_ref * ref_struct );
 
 /* Allocate reads */
@@ -293,6 +437,12 @@ int rapi_reads_reserve(rapi_batch * batch, int n_fragments);
 
 /**
  * Set read data within a batch.  The strings are copied into the read batch.
+ * Reads in the same batch must not be set concurrently from multiple threads.
+ *
+ * The sequence is converted to upper case.  Reads with bases other than
+ * [ACGTNacgtn], or with qualities outside the Sanger range (0 to 93) once
+ * q_offset is applied, are rejected with RAPI_PARAM_ERROR and the position
+ * of the first bad base is reported on stderr.
  *
  * \param n_frag 0-based fragment number
  * \param n_read 0-based read number
@@ -303,21 +453,205 @@ int rapi_reads_reserve(rapi_batch * batch, int n_fragments);
  */
 int rapi_set_read(rapi_batch * batch, int n_frag, int n_read, const char* id, const char* seq, const char* qual, int q_offset);
 
+/**
+ * Like rapi_set_read, but takes the string lengths so that the input strings
+ * don't have to be NULL-terminated.  `qual`, if not NULL, must hold seq_len bytes.
+ */
+int rapi_set_read_n(rapi_batch * batch, int n_frag, int n_read,
+                    const char* id, int id_len,
+                    const char* seq, int seq_len,
+                    const char* qual, int q_offset);
+
+/**
+ * Set read data within a batch without copying the sequence and quality:
+ * the read points directly into the caller's buffers, which must remain
+ * valid and unchanged until the batch is cleared or freed.  The strings
+ * need not be NULL-terminated, so use the read's `length` to access them.
+ *
+ * The id is still copied (it's short and it needs to be terminated), as are
+ * the qualities if q_offset isn't RAPI_QUALITY_ENCODING_SANGER, since they
+ * have to be recoded.  The data are validated as in rapi_set_read, but the
+ * sequence is not converted to upper case.
+ */
+int rapi_set_read_ref(rapi_batch * batch, int n_frag, int n_read,
+                      const char* id, int id_len,
+                      const char* seq, int seq_len,
+                      const char* qual, int q_offset);
+
+/**
+ * Set n_reads consecutive reads, starting from the first read of fragment
+ * first_frag, from concatenated buffers.  Read i is made of the bytes
+ * [id_offsets[i], id_offsets[i+1]) of `ids` and [seq_offsets[i],
+ * seq_offsets[i+1]) of `seqs`, so the offset arrays have n_reads + 1
+ * entries.  `quals`, if not NULL, is laid out like `seqs` and uses the same
+ * offsets.  The strings are copied as by rapi_set_read_n.
+ *
+ * The batch is grown as needed to fit the reads.  If a read is rejected the
+ * function stops and returns the error, leaving the reads before it set.
+ */
+int rapi_set_reads_bulk(rapi_batch * batch, int first_frag, int n_reads,
+                        const char* ids, const size_t* id_offsets,
+                        const char* seqs, const size_t* seq_offsets,
+                        const char* quals, int q_offset);
+
+/**
+ * Choose whether the sequences subsequently set with rapi_set_read and
+ * rapi_set_read_n are stored in the packed 2-bit form described for
+ * rapi_read, which takes 3 bits per base instead of 8.
+ * Reads set with rapi_set_read_ref are never packed.
+ */
+int rapi_reads_set_packed( rapi_batch * batch, int packed );
+
+/**
+ * Drop the data of all the reads in the batch, and their alignments, so
+ * that the batch can be refilled.  The batch keeps its size and the memory
+ * it has allocated, which is reused by the following rapi_set_read and
+ * rapi_align_reads calls.
+ */
+int rapi_reads_clear( rapi_batch * batch );
+
 int rapi_reads_free( rapi_batch * batch );
 
+/* FASTQ input */
+typedef struct rapi_fastq_reader rapi_fastq_reader; //< opaque structure
+
+/**
+ * Open a FASTQ file, or a pair of them, for reading into read batches.  The
+ * files may be plain text or gzip-compressed.  Decompression and parsing run
+ * on a background thread owned by the reader.
+ *
+ * \param path1 first (or only) file
+ * \param path2 file with the second reads of each pair, or NULL
+ * \param interleaved if set (and path2 is NULL) consecutive records in path1 form pairs
+ * \param q_offset base quality offset used in the files (see rapi_set_read)
+ */
+int rapi_fastq_open(const char* path1, const char* path2, int interleaved, int q_offset, rapi_fastq_reader** ret_reader);
+
+/* Number of reads per fragment produced by the reader (1 or 2). */
+int rapi_fastq_reads_per_frag(const rapi_fastq_reader* reader);
+
+int rapi_fastq_close(rapi_fastq_reader* reader);
+
+/**
+ * Read up to max_frags fragments from `reader` into `batch`, starting at
+ * fragment 0, and set *n_filled to the number of fragments read -- 0 once
+ * the input is exhausted.  The batch is grown to max_frags fragments if
+ * needed, and never shrunk, so that it can be refilled without
+ * reallocating.  To align a batch that was filled only partly (typically
+ * the last one), set batch->n_frags to *n_filled first.
+ *
+ * The batch must have been allocated with as many reads per fragment as
+ * the reader produces.  To reuse a batch, empty it with rapi_reads_clear
+ * before filling it again.
+ *
+ * On error *n_filled counts only the complete fragments read before it.
+ * Mates whose names differ (ignoring /1 and /2) are an error
+ * (RAPI_PARAM_ERROR).
+ */
+int rapi_batch_fill_fastq(rapi_fastq_reader* reader, rapi_batch* batch, int max_frags, int* n_filled);
+
 /* Align */
 typedef struct rapi_aligner_state rapi_aligner_state; //< opaque structure.  Aligner can use for whatever it wants.
 
+/*
+ * Create an aligner state.  The state owns a pool of opts->n_threads worker
+ * threads that is reused by every rapi_align_reads call made with it, so the
+ * thread count is fixed for the lifetime of the state.
+ */
 int rapi_aligner_state_init(const rapi_opts* opts, struct rapi_aligner_state** ret_state);
 
 int rapi_align_reads( const rapi_ref* ref,  rapi_batch * batch, const rapi_opts * config, rapi_aligner_state* state );
 
+/*
+ * Called by rapi_align_reads_async once `batch` has been aligned, with the
+ * return code that rapi_align_reads would have given.  The callback runs on
+ * a thread owned by the aligner state and should return quickly, since the
+ * next batch won't start until it does.
+ *
+ * The callback may queue more batches, and may call rapi_aligner_state_wait,
+ * which then aligns the batches queued after this one before returning.  It
+ * must not free the state:  rapi_aligner_state_free fails with
+ * RAPI_OP_NOT_SUPPORTED_ERROR when called from a callback.
+ */
+typedef void (*rapi_align_callback)(rapi_batch* batch, int error, void* user_data);
+
+/*
+ * Queue `batch` for alignment and return immediately.  Batches are aligned in
+ * submission order, one at a time, on the state's worker pool.
+ *
+ * The caller must not touch `batch`, `ref` or `config` until the callback
+ * for the batch has been called.
+ */
+int rapi_align_reads_async( const rapi_ref* ref,  rapi_batch * batch, const rapi_opts * config, rapi_aligner_state* state,
+                            rapi_align_callback callback, void* user_data );
+
+/* Block until all the batches submitted with rapi_align_reads_async have completed. */
+int rapi_aligner_state_wait(rapi_aligner_state* state);
+
+/*
+ * Counters of the alignment cache of an aligner state, created with
+ * rapi_opts.aln_cache_bytes.  The cache maps the sequences of a fragment to
+ * the alignments computed for it, so fragments repeated across batches are
+ * aligned once.  It's emptied when the state is used with another index
+ * or with different options.  Only paired-end batches use it, once the
+ * insert-size estimate is frozen (see rapi_aligner_state_get_insert_size),
+ * and it's emptied if the estimate is then set again.
+ */
+typedef struct {
+	uint64_t hits;      // fragments whose alignments came from the cache
+	uint64_t misses;    // fragments looked up and aligned
+	uint64_t n_entries;
+	uint64_t bytes;     // in use, including the overhead of the entries
+	uint64_t capacity;
+} rapi_aln_cache_stats;
+
+/* Blocks while a batch is being aligned. */
+int rapi_aligner_state_get_cache_stats(rapi_aligner_state* state, rapi_aln_cache_stats* stats);
+
+/*
+ * Insert-size distribution of the FR pairs, as used by the aligner state.
+ * The state estimates it from the unique pairs of all the batches it has
+ * aligned, and stops updating it (freezes it) once it has converged.
+ */
+typedef struct {
+	double mean;
+	double stddev;
+	int low;          // proper pairs have insert sizes in [low, high]
+	int high;
+	int valid;        // 0 if there's no estimate yet, or too few FR pairs
+	int frozen;
+} rapi_insert_size;
+
+/*
+ * Set the insert-size distribution of the library, if known, for the FR
+ * orientation (like bwa mem -I).  With `freeze` it's used as is;  otherwise
+ * it's replaced by the estimate from the data once there are enough pairs.
+ */
+int rapi_aligner_state_set_insert_size(rapi_aligner_state* state, double mean, double stddev, int freeze);
+
+/* Blocks while a batch is being aligned. */
+int rapi_aligner_state_get_insert_size(rapi_aligner_state* state, rapi_insert_size* isize);
+
 int rapi_aligner_state_free(struct rapi_aligner_state* state);
 
 static inline rapi_read* rapi_get_read(const rapi_batch* batch, int n_fragment, int n_read) {
 	return batch->reads + (n_fragment * batch->n_reads_frag + n_read);
 }
 
+/* Get base i of the read as a letter, whether or not the sequence is packed. */
+static inline char rapi_read_base(const rapi_read* read, unsigned int i) {
+	if (!read->seq_packed)
+		return read->seq[i];
+	const uint8_t* codes = (const uint8_t*)read->seq;
+	const uint8_t* n_mask = codes + (read->length + 3) / 4;
+	if (n_mask[i >> 3] & (1 << (i & 7)))
+		return 'N';
+	return "ACGT"[(codes[i >> 2] >> ((i & 3) << 1)) & 3];
+}
+
+/* Write the read's sequence as text to `buf`, which must hold length + 1 chars. */
+int rapi_read_get_seq(const rapi_read* read, char* buf);
+
 long rapi_get_insert_size(const rapi_alignment* read, const rapi_alignment* mate);
 
 static inline int rapi_get_rlen(int n_cigar, const rapi_cigar* cigar_ops)
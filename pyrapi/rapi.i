@@ -92,11 +92,28 @@ or they won't have effect.
     if (error != RAPI_NO_ERROR)
       PyErr_SetString(rapi_py_error_type(error), "Error initializing library");
   }
+
+  /* rapi_ref_build, raising an exception on error */
+  void build_ref(const char* fasta_path, const char* out_prefix, int n_threads = 1,
+                 size_t mem_budget = 0, int sa_intv = RAPI_REF_BUILD_SA_INTV) {
+    int error = rapi_ref_build_sampled(fasta_path, out_prefix, n_threads, mem_budget, sa_intv);
+    if (error != RAPI_NO_ERROR)
+      PyErr_SetString(rapi_py_error_type(error), "Error building reference index");
+  }
 %};
 
 #define QENC_SANGER   33
 #define QENC_ILLUMINA 64
 
+#define REF_LOAD_HEAP      0x0
+#define REF_LOAD_MMAP      0x1
+#define REF_MMAP_POPULATE  0x2
+#define REF_MMAP_HUGETLB   0x4
+#define REF_LOAD_METADATA  0x8
+#define REF_LOAD_NUMA      0x10
+#define REF_LOAD_HUGEPAGES 0x20
+#define REF_HUGEPAGES_1G   0x40
+
 /*
 These are wrapped automatically by SWIG -- the wrapper doesn't try to free the
 strings since they are "const".
@@ -148,6 +165,14 @@ typedef struct {
   int mapq_min;
   int isize_min;
   int isize_max;
+  int n_threads;
+  int pin_threads;
+  int exact_fast_path;
+  int collapse_duplicates;
+  size_t aln_cache_bytes;
+  size_t sa_cache_bytes;
+  int sched_chunk;
+  int sched_cost_order;
   /* Mismatch / Gap_Opens / Quality Trims --> Generalize ? */
 
   // TODO: how to wrap this thing?
@@ -254,11 +279,11 @@ typedef struct {
 
 %feature("python:slot", "tp_iter", functype="getiterfunc") rapi_ref::rapi___iter__;
 %extend rapi_ref {
-  rapi_ref(const char* reference_path) {
+  rapi_ref(const char* reference_path, int flags = RAPI_REF_LOAD_HEAP) {
     rapi_ref* ref = (rapi_ref*) rapi_malloc(sizeof(rapi_ref));
     if (!ref) return NULL;
 
-    int error = rapi_ref_load(reference_path, ref);
+    int error = rapi_ref_load_flags(reference_path, flags, ref);
     if (error == RAPI_NO_ERROR)
       return ref;
     else {
@@ -312,18 +337,83 @@ typedef struct {
 %feature("python:slot", "sq_length", functype="lenfunc") rapi_read::rapi___len__;
 typedef struct {
   char * id;
-  char * seq;
-  char * qual;
   unsigned int length;
   rapi_alignment* alignments;
   uint8_t n_alignments;
+  uint8_t seq_packed;
 } rapi_read;
 
+/* seq and qual aren't NULL-terminated if set by rapi_set_read_ref, so they're
+   read through getters that stop at the read's length.  Packed sequences
+   are decoded. */
+%fragment("rapi_read_getters", "header", fragment="SWIG_FromCharPtrAndSize") {
+PyObject* rapi_read_seq_get(const rapi_read* read) {
+  if (!read->seq)
+    return SWIG_FromCharPtrAndSize(NULL, 0);
+  char* buf = (char*) rapi_malloc(read->length + 1);
+  if (!buf) return NULL;
+  rapi_read_get_seq(read, buf);
+  PyObject* seq = SWIG_FromCharPtrAndSize(buf, read->length);
+  free(buf);
+  return seq;
+}
+
+PyObject* rapi_read_qual_get(const rapi_read* read) {
+  return SWIG_FromCharPtrAndSize(read->qual, read->length);
+}
+}
+%fragment("rapi_read_getters");
+
+%newobject rapi_read::get_seq;
 %extend rapi_read {
+  PyObject* seq; // read-only (see %immutable above)
+  PyObject* qual;
+
   size_t rapi___len__() { return $self->length; }
+
+  /** The read's sequence as text, decoded if it's packed. */
+  char* get_seq() {
+    char* buf = (char*) rapi_malloc($self->length + 1);
+    if (buf)
+      rapi_read_get_seq($self, buf);
+    return buf;
+  }
 };
 
 
+/****** FASTQ input *******/
+
+%inline %{
+  typedef struct {
+    rapi_fastq_reader* reader;
+  } rapi_fastq_wrap;
+%}
+
+%extend rapi_fastq_wrap {
+  rapi_fastq_wrap(const char* path1, const char* path2 = NULL, int interleaved = 0, int q_offset = RAPI_QUALITY_ENCODING_SANGER) {
+    rapi_fastq_wrap* wrapper = (rapi_fastq_wrap*) rapi_malloc(sizeof(rapi_fastq_wrap));
+    if (!wrapper) return NULL;
+
+    int error = rapi_fastq_open(path1, path2, interleaved, q_offset, &wrapper->reader);
+    if (error != RAPI_NO_ERROR) {
+      free(wrapper);
+      PyErr_SetString(rapi_py_error_type(error), "Error opening FASTQ input");
+      return NULL;
+    }
+    return wrapper;
+  }
+
+  ~rapi_fastq_wrap() {
+    int error = rapi_fastq_close($self->reader);
+    free($self);
+    if (error != RAPI_NO_ERROR) {
+      PDEBUG("Problem closing FASTQ reader (error code %d)\n", error);
+    }
+  }
+
+  int reads_per_frag() { return rapi_fastq_reads_per_frag($self->reader); }
+};
+
 //%rename("batch") "rapi_batch_wrap"; // how do I make this rename work properly?
 
 %feature("python:slot", "sq_length", functype="lenfunc") rapi_batch_wrap::rapi___len__;
@@ -394,11 +484,6 @@ typedef struct {
 
     if (error != RAPI_NO_ERROR)
       PyErr_SetString(rapi_py_error_type(error), "Failed to reserve space");
-    else {
-      for (int i = 0; i < $self->len; ++i) {
-        PDEBUG("i: %d; n_alignments: %d\n", i, $self->batch->reads[i].n_alignments);
-      }
-    }
   }
 
   void append(const char* id, const char* seq, const char* qual, int q_offset) {
@@ -419,7 +504,6 @@ typedef struct {
         return;
       }
     }
-    PDEBUG("Setting read %d of fragment %d\n", read_num, fragment_num);
     int error = rapi_set_read($self->batch, fragment_num, read_num, id, seq, qual, q_offset);
     if (error != RAPI_NO_ERROR) {
       PyErr_SetString(rapi_py_error_type(error), "Error inserting read.");
@@ -428,6 +512,82 @@ typedef struct {
       ++$self->len;
   }
 
+  /** Append many reads with a single call.  `ids`, `seqs` and `quals` (which
+   *  may be None) hold one read per line, in the same order, and must have
+   *  the same number of lines.  Returns the number of reads appended.
+   */
+  int append_bulk(const char* ids, const char* seqs, const char* quals, int q_offset) {
+    // count the lines:  a trailing newline doesn't start another read
+    size_t n_reads = 0;
+    size_t seqs_len = strlen(seqs);
+    for (const char* p = seqs; (p = memchr(p, '\n', seqs + seqs_len - p)); ++p)
+      ++n_reads;
+    if (seqs_len > 0 && seqs[seqs_len - 1] != '\n')
+      ++n_reads;
+    if (n_reads == 0)
+      return 0;
+
+    // Copy the text without the newlines and compute the offsets of the reads
+    size_t ids_len = strlen(ids);
+    size_t* id_offsets = (size_t*) rapi_malloc(2 * (n_reads + 1) * sizeof(size_t));
+    char* buf = (char*) rapi_malloc(ids_len + 2 * seqs_len + 1);
+    if (!id_offsets || !buf) {
+      free(id_offsets);
+      free(buf);
+      PyErr_NoMemory();
+      return 0;
+    }
+    size_t* seq_offsets = id_offsets + n_reads + 1;
+    char* id_buf = buf;
+    char* seq_buf = id_buf + ids_len;
+    char* qual_buf = quals ? seq_buf + seqs_len : NULL;
+
+    int error = RAPI_NO_ERROR;
+    const char* id_p = ids;
+    const char* seq_p = seqs;
+    const char* qual_p = quals;
+    id_offsets[0] = seq_offsets[0] = 0;
+    for (size_t i = 0; i < n_reads && !error; ++i) {
+      size_t id_len = strcspn(id_p, "\n");
+      size_t seq_len = strcspn(seq_p, "\n");
+      if ((id_p[id_len] == '\0' && i < n_reads - 1) || (quals && strcspn(qual_p, "\n") != seq_len)) {
+        error = RAPI_PARAM_ERROR;
+        break;
+      }
+      memcpy(id_buf + id_offsets[i], id_p, id_len);
+      memcpy(seq_buf + seq_offsets[i], seq_p, seq_len);
+      if (quals) {
+        memcpy(qual_buf + seq_offsets[i], qual_p, seq_len);
+        qual_p += seq_len + (qual_p[seq_len] == '\n');
+      }
+      id_offsets[i + 1] = id_offsets[i] + id_len;
+      seq_offsets[i + 1] = seq_offsets[i] + seq_len;
+      id_p += id_len + (id_p[id_len] == '\n');
+      seq_p += seq_len + (seq_p[seq_len] == '\n');
+    }
+    // ids and quals must not have more lines than seqs either
+    if (error == RAPI_NO_ERROR && (*id_p != '\0' || (quals && *qual_p != '\0')))
+      error = RAPI_PARAM_ERROR;
+
+    if (error == RAPI_NO_ERROR) {
+      // the reads go after the ones already in the batch, which may end mid-fragment
+      if ($self->len % $self->batch->n_reads_frag != 0)
+        error = RAPI_PARAM_ERROR;
+      else
+        error = rapi_set_reads_bulk($self->batch, $self->len / $self->batch->n_reads_frag, n_reads,
+            id_buf, id_offsets, seq_buf, seq_offsets, qual_buf, q_offset);
+    }
+    free(id_offsets);
+    free(buf);
+
+    if (error != RAPI_NO_ERROR) {
+      PyErr_SetString(rapi_py_error_type(error), "Error inserting reads (the batch must end on a fragment boundary and the lines must match)");
+      return 0;
+    }
+    $self->len += n_reads;
+    return n_reads;
+  }
+
   void set_read(int n_frag, int n_read, const char* id, const char* seq, const char* qual, int q_offset) {
     if (n_frag < 0 || n_read < 0) {
       PyErr_SetString(rapi_py_error_type(RAPI_PARAM_ERROR), "read and fragment indices cannot be negative");
@@ -446,11 +606,41 @@ typedef struct {
     }
   }
 
+  /** Store the sequences of the reads set from now on in packed 2-bit form. */
+  void set_packed(int packed) {
+    rapi_reads_set_packed($self->batch, packed);
+  }
+
+  /** Remove all reads from the batch, keeping the allocated space for reuse. */
+  void clear() {
+    int error = rapi_reads_clear($self->batch);
+    if (error != RAPI_NO_ERROR)
+      PyErr_SetString(rapi_py_error_type(error), "Error clearing batch");
+    else
+      $self->len = 0;
+  }
+
+  /** Fill the (empty) batch with up to max_frags fragments from `reader`.
+   *  Returns the number of fragments read; 0 at the end of the input.
+   */
+  int fill_fastq(rapi_fastq_wrap* reader, int max_frags) {
+    if ($self->len > 0) {
+      PyErr_SetString(PyExc_ValueError, "fill_fastq requires an empty batch");
+      return 0;
+    }
+
+    int n_filled = 0;
+    int error = rapi_batch_fill_fastq(reader->reader, $self->batch, max_frags, &n_filled);
+    if (error != RAPI_NO_ERROR) {
+      PyErr_SetString(rapi_py_error_type(error), "Error reading FASTQ input");
+      return 0;
+    }
+    $self->len = n_filled * $self->batch->n_reads_frag;
+    return n_filled;
+  }
+
   rapi_read* get_read(int n_fragment, int n_read) {
-    //return rapi_get_read($self->batch, n_fragment, n_read);
-    rapi_read* r = rapi_get_read($self->batch, n_fragment, n_read);
-    PDEBUG("number of alignments in this read: %d\n", r->n_alignments);
-    return r;
+    return rapi_get_read($self->batch, n_fragment, n_read);
   }
 }
 
@@ -3,6 +3,9 @@
  */
 
 #include <rapi.h>
+#include "rapi_index.h"
+#include "rapi_pestat.h"
+#include "rapi_seed.h"
 #include <bwamem.h>
 #include <kstring.h>
 #include <kvec.h>
@@ -12,6 +15,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <pthread.h>
 
 
 const char vtype_char[] = {
@@ -38,8 +42,11 @@ void rapi_print_read(FILE* out, const rapi_read* read)
 {
 	fprintf(out, "read id: %s\n", read->id);
 	fprintf(out, "read length: %d\n", read->length);
-	fprintf(out, "read seq: %s\n", read->seq);
-	fprintf(out, "read qual: %s\n", read->qual);
+	fprintf(out, "read seq: ");
+	for (unsigned int i = 0; i < read->length; ++i)
+		fputc(rapi_read_base(read, i), out);
+	fputc('\n', out);
+	fprintf(out, "read qual: %.*s\n", read->qual ? read->length : 0, read->qual ? read->qual : "");
 	fprintf(out, "read n_alignments: %u\n", read->n_alignments);
 }
 
@@ -201,14 +208,19 @@ int rapi_format_sam(const rapi_read* read, const rapi_read* mate, kstring_t* out
 		ks_resize(output, resize);
 
 		if (!aln->reverse_strand) { // the forward strand
-			kputsn(read->seq, read->length, output);
+			if (read->seq_packed) {
+				for (i = begin; i < end; ++i) output->s[output->l++] = rapi_read_base(read, i);
+				output->s[output->l] = 0;
+			}
+			else
+				kputsn(read->seq, read->length, output);
 			kputc('\t', output);
 			if (read->qual) { // printf qual
 				for (i = begin; i < end; ++i) output->s[output->l++] = read->qual[i];
 				output->s[output->l] = 0;
 			} else kputc('*', output);
 		} else { // the reverse strand
-			for (i = begin-1; i >= begin; --i) output->s[output->l++] = "TGCAN"[nst_nt4_table[(int)read->seq[i]]];
+			for (i = begin-1; i >= begin; --i) output->s[output->l++] = "TGCAN"[nst_nt4_table[(int)rapi_read_base(read, i)]];
 			kputc('\t', output);
 			if (read->qual) { // printf qual
 				for (i = begin-1; i >= begin; --i) output->s[output->l++] = read->qual[i];
@@ -261,13 +273,78 @@ int rapi_format_sam(const rapi_read* read, const rapi_read* mate, kstring_t* out
 
 
 /******** Internal structures *****/
+/*
+ * The reads of a rapi_batch, as handed to BWA.
+ *
+ * Names and qualities point directly to the rapi_read strings.  BWA
+ * modifies the sequences in place (it converts them to 2-bit codes), so
+ * they're given scratch space in seq_buf, a single buffer shared by the
+ * whole batch.  The worker threads fill it just before aligning each read.
+ *
+ * The structure is kept in the aligner state and its buffers are reused
+ * (and only grown) from one batch to the next.
+ */
 typedef struct {
 	unsigned long n_bases;
 	int n_reads;
 	int n_reads_per_frag;
 	bseq1_t* seqs;
+	int seqs_capacity;
+	char* seq_buf;
+	size_t seq_buf_size;
 } bwa_batch;
 
+/* Why a read is left out of the seeding (bwa_worker_t.skip) */
+#define SKIP_NONE       0
+#define SKIP_EXACT_HIT  1  // aligned by the exact-match fast path
+#define SKIP_DUPLICATE  2  // same fragment sequence as an earlier one
+#define SKIP_CACHED     3  // alignments found in the alignment cache
+// reads from SKIP_DUPLICATE up aren't aligned at all
+
+/*
+ * The duplicate fragments of a batch.  Fragments are hashed by their
+ * sequences (both reads for pairs) into an open-addressing table.  Kept in
+ * the aligner state and only grown, like bwa_batch.
+ */
+typedef struct {
+	uint64_t* hashes;  // per fragment
+	int* dup_of;       // per fragment:  index of its first copy, or -1
+	int frags_capacity;
+	int* slots;        // fragment indices, -1 if empty
+	int n_slots;       // allocated slots;  a batch uses a power of 2 of them
+} dup_index;
+
+/*
+ * An LRU cache of the alignments of fragments, kept by the aligner state
+ * across batches.  Each entry is a single allocation holding the reads'
+ * sequences and a deep copy of their alignments.
+ */
+typedef struct aln_cache_entry {
+	uint64_t hash;
+	struct aln_cache_entry* chain;   // next in the bucket
+	struct aln_cache_entry* newer;   // LRU list
+	struct aln_cache_entry* older;
+	size_t size;
+	int n_reads;
+	rapi_read reads[];  // only the sequences and alignments are set
+} aln_cache_entry;
+
+typedef struct {
+	size_t capacity;    // bytes;  0 if there's no cache
+	size_t bytes;
+	size_t n_entries;
+	uint64_t hits;
+	uint64_t misses;
+	aln_cache_entry** buckets;
+	size_t n_buckets;   // a power of 2
+	aln_cache_entry* newest;
+	aln_cache_entry* oldest;
+	// what the cached alignments depend on besides the reads (see _cache_key)
+	uint64_t ref_generation;
+	const rapi_contig* contigs; // the alignments point into these
+	uint64_t opts_hash;
+} aln_cache;
+
 void _print_bwa_batch(FILE* out, const bwa_batch* read_batch)
 {
 	fprintf(out, "batch with %ld bases, %d reads, %d reads per fragment",
@@ -287,15 +364,447 @@ void _print_bwa_batch(FILE* out, const bwa_batch* read_batch)
 	}
 }
 
+/******** Batch memory arena ******
+ * Storage for the read and alignment data of a rapi_batch.  Memory is
+ * carved sequentially out of large blocks and only released when the whole
+ * batch is freed.
+ *
+ * The arena is divided into lanes so that the worker threads can allocate
+ * without locking:  a thread only ever allocates from the lane matching its
+ * id, while lane 0 is also used for the data set by the caller through
+ * rapi_set_read.
+ */
+#define ARENA_ALIGNMENT       16
+#define ARENA_MIN_BLOCK_SIZE  (1 << 16)
+#define ARENA_MAX_BLOCK_SIZE  (1 << 22)
+
+typedef struct arena_block {
+	struct arena_block* next;
+	size_t size;
+	size_t used;
+	char data[];
+} arena_block;
+
+typedef struct {
+	arena_block* blocks;    // list of blocks in use.  The head is the one being filled.
+	arena_block* spare;     // blocks released by _arena_reset, available for reuse
+	size_t next_block_size;
+} arena_lane;
+
+struct rapi_arena {
+	int n_lanes;
+	arena_lane* lanes;
+};
+
+static rapi_arena* _arena_new(void)
+{
+	rapi_arena* arena = calloc(1, sizeof(rapi_arena));
+	if (NULL == arena)
+		return NULL;
+	arena->lanes = calloc(1, sizeof(arena_lane));
+	if (NULL == arena->lanes) {
+		free(arena);
+		return NULL;
+	}
+	arena->n_lanes = 1;
+	return arena;
+}
+
+static void _arena_free_blocks(arena_block* b)
+{
+	while (b) {
+		arena_block* next = b->next;
+		free(b);
+		b = next;
+	}
+}
+
+static void _arena_free(rapi_arena* arena)
+{
+	if (NULL == arena)
+		return;
+	for (int i = 0; i < arena->n_lanes; ++i) {
+		_arena_free_blocks(arena->lanes[i].blocks);
+		_arena_free_blocks(arena->lanes[i].spare);
+	}
+	free(arena->lanes);
+	free(arena);
+}
+
+/*
+ * Release everything allocated from the arena, but keep the blocks so
+ * that they can be reused by the following allocations.
+ */
+static void _arena_reset(rapi_arena* arena)
+{
+	for (int i = 0; i < arena->n_lanes; ++i) {
+		arena_lane* lane = &arena->lanes[i];
+		while (lane->blocks) {
+			arena_block* b = lane->blocks;
+			lane->blocks = b->next;
+			b->used = 0;
+			b->next = lane->spare;
+			lane->spare = b;
+		}
+	}
+}
+
+/* Take a spare block with at least `size` bytes out of the lane, if there is one. */
+static arena_block* _arena_take_spare(arena_lane* lane, size_t size)
+{
+	for (arena_block** p = &lane->spare; *p; p = &(*p)->next) {
+		if ((*p)->size >= size) {
+			arena_block* b = *p;
+			*p = b->next;
+			return b;
+		}
+	}
+	return NULL;
+}
+
+/* Make sure the arena has at least n_lanes lanes.  Not thread-safe. */
+static int _arena_reserve_lanes(rapi_arena* arena, int n_lanes)
+{
+	if (n_lanes <= arena->n_lanes)
+		return RAPI_NO_ERROR;
+	arena_lane* lanes = realloc(arena->lanes, n_lanes * sizeof(arena_lane));
+	if (NULL == lanes)
+		return RAPI_MEMORY_ERROR;
+	memset(lanes + arena->n_lanes, 0, (n_lanes - arena->n_lanes) * sizeof(arena_lane));
+	arena->lanes = lanes;
+	arena->n_lanes = n_lanes;
+	return RAPI_NO_ERROR;
+}
+
+/* Allocate `size` bytes from the given lane.  Returns NULL if out of memory. */
+static void* _arena_alloc(rapi_arena* arena, int lane_id, size_t size)
+{
+	arena_lane* lane = &arena->lanes[lane_id];
+	size = (size + ARENA_ALIGNMENT - 1) & ~((size_t)ARENA_ALIGNMENT - 1);
+
+	arena_block* b = lane->blocks;
+	if (NULL == b || b->size - b->used < size) {
+		b = _arena_take_spare(lane, size);
+		if (NULL == b) {
+			if (lane->next_block_size == 0)
+				lane->next_block_size = ARENA_MIN_BLOCK_SIZE;
+			size_t block_size = lane->next_block_size > size ? lane->next_block_size : size;
+			b = malloc(sizeof(arena_block) + block_size);
+			if (NULL == b)
+				return NULL;
+			b->size = block_size;
+			b->used = 0;
+			if (lane->next_block_size < ARENA_MAX_BLOCK_SIZE)
+				lane->next_block_size <<= 1;
+		}
+		b->next = lane->blocks;
+		lane->blocks = b;
+	}
+	void* p = b->data + b->used;
+	b->used += size;
+	return p;
+}
+
+static void* _arena_calloc(rapi_arena* arena, int lane_id, size_t n, size_t size)
+{
+	void* p = _arena_alloc(arena, lane_id, n * size);
+	if (p)
+		memset(p, 0, n * size);
+	return p;
+}
+
+static char* _arena_strndup(rapi_arena* arena, int lane_id, const char* s, size_t len)
+{
+	char* p = _arena_alloc(arena, lane_id, len + 1);
+	if (p) {
+		memcpy(p, s, len);
+		p[len] = '\0';
+	}
+	return p;
+}
+
+/* Get the batch's arena, creating it if the batch doesn't have one yet. */
+static rapi_arena* _batch_arena(rapi_batch* batch)
+{
+	if (NULL == batch->_arena)
+		batch->_arena = _arena_new();
+	return batch->_arena;
+}
+
+/******** Worker pool *************
+ * A fixed set of threads created along with the aligner state and reused
+ * by every call to rapi_align_reads.  It takes the place of BWA's kt_for,
+ * which creates and joins its threads on every invocation.
+ *
+ * The thread that calls _pool_for participates in the work as thread 0, so
+ * a pool of n_threads only starts n_threads - 1 threads.  With
+ * rapi_opts.pin_threads the started threads are pinned to the NUMA nodes,
+ * so that they can keep using the copy of the index on their node.
+ *
+ * The items of a job are grouped in chunks.  Thread t processes chunks t,
+ * t + n_threads, ... and, once it runs out, steals the next chunk of the
+ * thread that is furthest behind, as kt_for does in later BWA versions.
+ * So a thread stuck on expensive items doesn't hold up the others.
+ */
+typedef void (*pool_func_t)(void* data, int i, int tid);
+
+/* A thread's next chunk, padded so that the threads don't share cache lines */
+typedef struct {
+	long next;
+	char pad[64 - sizeof(long)];
+} pool_cursor;
+
+typedef struct {
+	int n_threads;
+	pthread_t* threads;
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;   // signalled when a new job is posted (or at shutdown)
+	pthread_cond_t done_cond;   // signalled when the last worker finishes a job
+	// the current job
+	pool_func_t func;
+	void* data;
+	int n;
+	int chunk;                  // items per chunk
+	long n_chunks;
+	pool_cursor* cursors;       // per thread;  updated atomically
+	int n_running;              // number of workers still processing the job
+	unsigned long job_id;       // incremented every time a job is posted
+	int shutdown;
+	int* nodes;                 // NUMA node each thread is pinned to, or -1;  NULL if not pinning
+} worker_pool;
+
+typedef struct {
+	worker_pool* pool;
+	int tid;
+} worker_pool_slot;
+
+static inline void _pool_run_chunk(worker_pool* pool, long c, int tid)
+{
+	const long end = (c + 1) * pool->chunk < pool->n ? (c + 1) * pool->chunk : pool->n;
+	for (long i = c * pool->chunk; i < end; ++i)
+		pool->func(pool->data, (int)i, tid);
+}
+
+static void _pool_run_items(worker_pool* pool, int tid)
+{
+	const int n_threads = pool->n_threads;
+	long c;
+	while ((c = __sync_fetch_and_add(&pool->cursors[tid].next, n_threads)) < pool->n_chunks)
+		_pool_run_chunk(pool, c, tid);
+
+	// steal from the thread with the most work left
+	while (1) {
+		int victim = -1;
+		long min = pool->n_chunks;
+		for (int t = 0; t < n_threads; ++t) {
+			const long next = __atomic_load_n(&pool->cursors[t].next, __ATOMIC_RELAXED);
+			if (next < min) {
+				min = next;
+				victim = t;
+			}
+		}
+		if (victim < 0)
+			break;
+		if ((c = __sync_fetch_and_add(&pool->cursors[victim].next, n_threads)) < pool->n_chunks)
+			_pool_run_chunk(pool, c, tid);
+	}
+}
+
+static void* _pool_thread(void* arg)
+{
+	worker_pool_slot* slot = (worker_pool_slot*)arg;
+	worker_pool* pool = slot->pool;
+	const int tid = slot->tid;
+	free(slot);
+
+	if (pool->nodes)
+		pool->nodes[tid] = rapi_bwa_pin_thread(tid - 1);
+
+	unsigned long seen_job = 0;
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (!pool->shutdown && pool->job_id == seen_job)
+			pthread_cond_wait(&pool->work_cond, &pool->lock);
+		if (pool->shutdown)
+			break;
+		seen_job = pool->job_id;
+		pthread_mutex_unlock(&pool->lock);
+
+		_pool_run_items(pool, tid);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->n_running == 0)
+			pthread_cond_signal(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static void _pool_destroy(worker_pool* pool);
+
+static int _pool_init(worker_pool** ret_pool, int n_threads, int pin_threads)
+{
+	if (n_threads < 1)
+		return RAPI_PARAM_ERROR;
+
+	worker_pool* pool = *ret_pool = calloc(1, sizeof(worker_pool));
+	if (NULL == pool)
+		return RAPI_MEMORY_ERROR;
+
+	pool->threads = calloc(n_threads, sizeof(pthread_t));
+	pool->cursors = calloc(n_threads, sizeof(pool_cursor));
+	if (pin_threads)
+		pool->nodes = malloc(n_threads * sizeof(int));
+	if (NULL == pool->threads || NULL == pool->cursors || (pin_threads && NULL == pool->nodes)) {
+		free(pool->threads);
+		free(pool->cursors);
+		free(pool->nodes);
+		free(pool);
+		*ret_pool = NULL;
+		return RAPI_MEMORY_ERROR;
+	}
+	if (pool->nodes)
+		pool->nodes[0] = -1; // the calling thread isn't pinned
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	// n_threads counts the threads started so far, so that _pool_destroy
+	// only joins those in case of error
+	pool->n_threads = 1;
+	for (int t = 1; t < n_threads; ++t) {
+		worker_pool_slot* slot = malloc(sizeof(*slot));
+		if (NULL == slot) {
+			_pool_destroy(pool);
+			*ret_pool = NULL;
+			return RAPI_MEMORY_ERROR;
+		}
+		slot->pool = pool;
+		slot->tid = t;
+		if (pthread_create(&pool->threads[t], NULL, _pool_thread, slot) != 0) {
+			fprintf(stderr, "Failed to start worker thread %d\n", t);
+			free(slot);
+			_pool_destroy(pool);
+			*ret_pool = NULL;
+			return RAPI_GENERIC_ERROR;
+		}
+		pool->n_threads += 1;
+	}
+	return RAPI_NO_ERROR;
+}
+
+static void _pool_destroy(worker_pool* pool)
+{
+	if (NULL == pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int t = 1; t < pool->n_threads; ++t)
+		pthread_join(pool->threads[t], NULL);
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool->cursors);
+	free(pool->nodes);
+	free(pool);
+}
+
+/* The NUMA node where thread tid is running, or -1 if unknown */
+static inline int _pool_thread_node(const worker_pool* pool, int tid)
+{
+	if (pool->nodes && pool->nodes[tid] >= 0)
+		return pool->nodes[tid];
+	return rapi_bwa_current_node();
+}
+
+/*
+ * Call func(data, i, tid) for i in [0, n), distributing the calls over the
+ * pool's threads in chunks of `chunk` consecutive items.  Same contract as
+ * BWA's kt_for.  Returns when all the items have been processed.
+ */
+static void _pool_for(worker_pool* pool, pool_func_t func, void* data, int n, int chunk)
+{
+	if (n <= 0)
+		return;
+	if (chunk < 1)
+		chunk = 1;
+
+	if (pool->n_threads == 1) {
+		for (int i = 0; i < n; ++i)
+			func(data, i, 0);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->func = func;
+	pool->data = data;
+	pool->n = n;
+	pool->chunk = chunk;
+	pool->n_chunks = (n + chunk - 1) / chunk;
+	for (int t = 0; t < pool->n_threads; ++t)
+		pool->cursors[t].next = t;
+	pool->n_running = pool->n_threads - 1;
+	pool->job_id += 1;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	_pool_run_items(pool, 0);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->n_running > 0)
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
 /**********************************/
 
 /**
  * Definition of the aligner state structure.
  */
+typedef struct align_job {
+	const rapi_ref* ref;
+	rapi_batch* batch;
+	const rapi_opts* config;
+	rapi_align_callback callback;
+	void* user_data;
+	struct align_job* next;
+} align_job;
+
 struct rapi_aligner_state {
 	int64_t n_reads_processed;
-	// paired-end stats
-	mem_pestat_t pes[4];
+	// insert-size distribution, accumulated across batches
+	pestat_acc pestat;
+	worker_pool* pool;
+	// per-batch working space, reused across batches
+	bwa_batch bwa_seqs;
+	mem_alnreg_v* regs;
+	uint8_t* skip;       // per read, one of SKIP_*
+	uint64_t* frag_order; // per fragment, for rapi_opts.sched_cost_order
+	int regs_capacity;
+	dup_index dups;
+	aln_cache cache;
+	// positions of repetitive seeds, shared by the workers;  NULL if disabled
+	sa_cache* sa_cache;
+	uint64_t sa_cache_generation; // of the bwa_ref whose positions are in sa_cache
+	// serializes alignments, since they share the pool and the stats above
+	pthread_mutex_t align_lock;
+
+	// queue of batches submitted with rapi_align_reads_async
+	pthread_mutex_t queue_lock;
+	pthread_cond_t queue_cond;   // signalled when a job is queued (or at shutdown)
+	pthread_cond_t idle_cond;    // signalled when the queue has been drained
+	align_job* queue_head;
+	align_job* queue_tail;
+	int n_jobs;                  // queued plus running
+	int dispatcher_running;
+	int shutdown;
+	pthread_t dispatcher;
 };
 
 
@@ -360,6 +869,14 @@ int rapi_opts_init( rapi_opts * my_opts )
 	my_opts->mapq_min     = 0;
 	my_opts->isize_min    = 0;
 	my_opts->isize_max    = bwa_opt->max_ins;
+	my_opts->n_threads    = bwa_opt->n_threads;
+	my_opts->pin_threads  = 0;
+	my_opts->exact_fast_path = 0;
+	my_opts->collapse_duplicates = 0;
+	my_opts->aln_cache_bytes = 0;
+	my_opts->sa_cache_bytes = 0;
+	my_opts->sched_chunk = 0;
+	my_opts->sched_cost_order = 0;
 	kv_init(my_opts->parameters);
 
 	return RAPI_NO_ERROR;
@@ -385,12 +902,16 @@ const char* rapi_aligner_version()
 /* Load Reference */
 int rapi_ref_load( const char * reference_path, rapi_ref * ref_struct )
 {
-	if ( NULL == ref_struct || NULL == reference_path )
-		return RAPI_PARAM_ERROR;
+	return rapi_ref_load_flags(reference_path, RAPI_REF_LOAD_HEAP, ref_struct);
+}
 
-	const bwaidx_t*const bwa_idx = bwa_idx_load(reference_path, BWA_IDX_ALL);
-	if ( NULL == bwa_idx )
-		return RAPI_GENERIC_ERROR;
+/*
+ * Fill in ref_struct for the loaded index `bwa_ref`, which it takes over
+ * (on error, bwa_ref is freed).
+ */
+static int _init_ref_struct(const char* reference_path, bwa_ref* bwa_ref, rapi_ref* ref_struct)
+{
+	const bwaidx_t*const bwa_idx = bwa_ref->idx;
 
 	// allocate memory
 	ref_struct->path = strdup(reference_path);
@@ -398,7 +919,7 @@ int rapi_ref_load( const char * reference_path, rapi_ref * ref_struct )
 	if ( NULL == ref_struct->path || NULL == ref_struct->contigs )
 	{
 		// if either allocations we free everything and return an error
-		bwa_idx_destroy((bwaidx_t*)bwa_idx);
+		rapi_bwa_ref_free(bwa_ref);
 		free(ref_struct->path);
 		free(ref_struct->contigs);
 		memset(ref_struct, 0, sizeof(*ref_struct));
@@ -417,16 +938,84 @@ int rapi_ref_load( const char * reference_path, rapi_ref * ref_struct )
 		c->uri = NULL;
 		c->md5 = NULL;
 	}
-	ref_struct->_private = (bwaidx_t*)bwa_idx;
+	ref_struct->_private = bwa_ref;
 
 	return RAPI_NO_ERROR;
 }
 
+int rapi_ref_load_flags( const char * reference_path, int flags, rapi_ref * ref_struct )
+{
+	if ( NULL == ref_struct || NULL == reference_path )
+		return RAPI_PARAM_ERROR;
+
+	bwa_ref* bwa_ref = NULL;
+	int error = rapi_bwa_ref_load(reference_path, flags, &bwa_ref);
+	if (error)
+		return error;
+	return _init_ref_struct(reference_path, bwa_ref, ref_struct);
+}
+
+int rapi_ref_save_snapshot( const rapi_ref * ref_struct, const char * path )
+{
+	if ( NULL == ref_struct || NULL == ref_struct->_private || NULL == path )
+		return RAPI_PARAM_ERROR;
+	int error = rapi_bwa_ref_wait(ref_struct->_private);
+	if (error)
+		return error;
+	return rapi_bwa_ref_save_snapshot(ref_struct->_private, path);
+}
+
+int rapi_ref_load_snapshot( const char * path, rapi_ref * ref_struct )
+{
+	if ( NULL == ref_struct || NULL == path )
+		return RAPI_PARAM_ERROR;
+
+	bwa_ref* bwa_ref = NULL;
+	int error = rapi_bwa_ref_load_snapshot(path, &bwa_ref);
+	if (error)
+		return error;
+	return _init_ref_struct(path, bwa_ref, ref_struct);
+}
+
+int rapi_ref_load_async( const char * reference_path, int flags, rapi_ref * ref_struct )
+{
+	if ( NULL == ref_struct || NULL == reference_path )
+		return RAPI_PARAM_ERROR;
+
+	bwa_ref* bwa_ref = NULL;
+	int error = rapi_bwa_ref_load_async(reference_path, flags, &bwa_ref);
+	if (error)
+		return error;
+	return _init_ref_struct(reference_path, bwa_ref, ref_struct);
+}
+
+int rapi_ref_get_progress( const rapi_ref * ref_struct, rapi_ref_progress * progress )
+{
+	if ( NULL == ref_struct || NULL == ref_struct->_private || NULL == progress )
+		return RAPI_PARAM_ERROR;
+	rapi_bwa_ref_get_progress(ref_struct->_private, progress);
+	return RAPI_NO_ERROR;
+}
+
+int rapi_ref_wait( const rapi_ref * ref_struct )
+{
+	if ( NULL == ref_struct || NULL == ref_struct->_private )
+		return RAPI_PARAM_ERROR;
+	return rapi_bwa_ref_wait(ref_struct->_private);
+}
+
+int rapi_ref_get_page_stats( const rapi_ref * ref_struct, rapi_ref_page_stats * stats )
+{
+	if ( NULL == ref_struct || NULL == ref_struct->_private || NULL == stats )
+		return RAPI_PARAM_ERROR;
+	return rapi_bwa_ref_get_page_stats(ref_struct->_private, stats);
+}
+
 /* Free Reference */
 int rapi_ref_free( rapi_ref * ref )
 {
 	// free bwa's part
-	bwa_idx_destroy(ref->_private);
+	rapi_bwa_ref_free(ref->_private);
 
 	// then free the rest of the structure
 	free(ref->path);
@@ -447,64 +1036,487 @@ int rapi_ref_free( rapi_ref * ref )
 	return RAPI_NO_ERROR;
 }
 
-void _free_bwa_batch_contents(bwa_batch* batch)
+void _free_bwa_batch(bwa_batch* batch)
 {
-	for (int i = 0; i < batch->n_reads; ++i) {
-		// *Don't* free the read id since it points to the original structure's string
-		free(batch->seqs[i].seq);
-		free(batch->seqs[i].qual);
-	}
-
 	free(batch->seqs);
+	free(batch->seq_buf);
 	memset(batch, 0, sizeof(bwa_batch));
 }
 
+static inline int _packed_seq_size(int len);
 
+/*
+ * Set up bwa_seqs to refer to the reads in `batch`.  Only pointers are
+ * set;  the sequences are copied to the scratch buffer by _load_bwa_seq.
+ */
 static int _batch_to_bwa_seq(const rapi_batch* batch, const rapi_opts* opts, bwa_batch* bwa_seqs)
 {
+	const int n_reads = batch->n_frags * batch->n_reads_frag;
+
 	bwa_seqs->n_bases = 0;
 	bwa_seqs->n_reads = 0;
 	bwa_seqs->n_reads_per_frag = batch->n_reads_frag;
-	fprintf(stderr, "Need to allocate %d elements of size %ld\n", batch->n_frags * batch->n_reads_frag, sizeof(bseq1_t));
 
-	bwa_seqs->seqs = calloc(batch->n_frags * batch->n_reads_frag, sizeof(bseq1_t));
-	if (NULL == bwa_seqs->seqs) {
-		fprintf(stderr, "Allocation failed!\n");
+	if (n_reads > bwa_seqs->seqs_capacity) {
+		bseq1_t* seqs = realloc(bwa_seqs->seqs, n_reads * sizeof(bseq1_t));
+		if (NULL == seqs)
+			return RAPI_MEMORY_ERROR;
+		bwa_seqs->seqs = seqs;
+		bwa_seqs->seqs_capacity = n_reads;
+	}
+
+	// lay out the scratch buffer, one NULL-terminated sequence after the other
+	size_t offset = 0;
+	for (int i = 0; i < n_reads; ++i) {
+		const rapi_read* rapi_read = batch->reads + i;
+		if (NULL == rapi_read->seq) {
+			fprintf(stderr, "Read %d in batch has no sequence\n", i);
+			return RAPI_PARAM_ERROR;
+		}
+		offset += rapi_read->length + 1;
+	}
+
+	if (offset > bwa_seqs->seq_buf_size) {
+		char* buf = realloc(bwa_seqs->seq_buf, offset);
+		if (NULL == buf)
+			return RAPI_MEMORY_ERROR;
+		bwa_seqs->seq_buf = buf;
+		bwa_seqs->seq_buf_size = offset;
+	}
+
+	offset = 0;
+	for (int i = 0; i < n_reads; ++i) {
+		const rapi_read* rapi_read = batch->reads + i;
+		bseq1_t* bwa_read = bwa_seqs->seqs + i;
+
+		// -- In bseq1_t, all strings are null-terminated.
+		// BWA only modifies seq, so the name and qual are shared with the rapi_read
+		bwa_read->seq = bwa_seqs->seq_buf + offset;
+		bwa_read->qual = rapi_read->qual;
+		bwa_read->name = rapi_read->id;
+		bwa_read->l_seq = rapi_read->length;
+		bwa_read->comment = NULL;
+		bwa_read->sam = NULL;
+		offset += rapi_read->length + 1;
+		bwa_seqs->n_bases += rapi_read->length;
+	}
+	bwa_seqs->n_reads = n_reads;
+	return RAPI_NO_ERROR;
+}
+
+/*
+ * Copy the read's sequence into its scratch space, already converted to
+ * the 2-bit codes that BWA uses internally (4 for N).  Packed sequences are
+ * already in that form, so they only need to be expanded.
+ */
+static inline void _load_bwa_seq(bseq1_t* bwa_read, const rapi_read* rapi_read)
+{
+	const int len = bwa_read->l_seq;
+	char* dst = bwa_read->seq;
+
+	if (rapi_read->seq_packed) {
+		const uint8_t* codes = (const uint8_t*)rapi_read->seq;
+		const uint8_t* n_mask = codes + (len + 3) / 4;
+		for (int i = 0; i < len; ++i)
+			dst[i] = (codes[i >> 2] >> ((i & 3) << 1)) & 3;
+		for (int b = 0; b < (len + 7) / 8; ++b) {
+			for (uint8_t m = n_mask[b]; m; m &= m - 1) // only visit the set bits
+				dst[(b << 3) + __builtin_ctz(m)] = 4;
+		}
+	}
+	else {
+		for (int i = 0; i < len; ++i)
+			dst[i] = nst_nt4_table[(unsigned char)rapi_read->seq[i]];
+	}
+	dst[len] = '\0';
+}
+
+/* Mix n bytes into the 64-bit hash h, eight at a time */
+static inline uint64_t _hash_bytes(uint64_t h, const void* data, size_t n)
+{
+	const unsigned char* p = data;
+	uint64_t w;
+	for (; n >= 8; n -= 8, p += 8) {
+		memcpy(&w, p, 8);
+		h = (h ^ (w * 0x87c37b91114253d5ULL)) * 0x4cf5ad432745937fULL;
+		h ^= h >> 31;
+	}
+	w = 0;
+	memcpy(&w, p, n);
+	h = (h ^ (w * 0x87c37b91114253d5ULL) ^ n) * 0x4cf5ad432745937fULL;
+	return h ^ (h >> 29);
+}
+
+/* Bytes taken by the sequence of a read, packed or not */
+static inline size_t _read_seq_size(const rapi_read* read)
+{
+	return read->seq_packed ? _packed_seq_size(read->length) : read->length;
+}
+
+static uint64_t _fragment_hash(const rapi_read* reads, int n_reads_frag)
+{
+	uint64_t h = n_reads_frag;
+	for (int j = 0; j < n_reads_frag; ++j)
+		h = _hash_bytes(h ^ ((uint64_t)reads[j].length << 1 | reads[j].seq_packed), reads[j].seq, _read_seq_size(&reads[j]));
+	return h;
+}
+
+static int _same_fragment(const rapi_read* a, const rapi_read* b, int n_reads_frag)
+{
+	for (int j = 0; j < n_reads_frag; ++j) {
+		if (a[j].length != b[j].length || a[j].seq_packed != b[j].seq_packed
+				|| memcmp(a[j].seq, b[j].seq, _read_seq_size(&a[j])))
+			return 0;
+	}
+	return 1;
+}
+
+/* Compute the hashes of the fragments in `batch`, used as keys by the duplicate index and cache */
+static int _hash_fragments(const rapi_batch* batch, dup_index* dups)
+{
+	const int n_frags = batch->n_frags;
+
+	if (n_frags > dups->frags_capacity) {
+		uint64_t* hashes = realloc(dups->hashes, n_frags * sizeof(uint64_t));
+		if (NULL == hashes)
+			return RAPI_MEMORY_ERROR;
+		dups->hashes = hashes;
+		int* dup_of = realloc(dups->dup_of, n_frags * sizeof(int));
+		if (NULL == dup_of)
+			return RAPI_MEMORY_ERROR;
+		dups->dup_of = dup_of;
+		dups->frags_capacity = n_frags;
+	}
+	for (int f = 0; f < n_frags; ++f)
+		dups->hashes[f] = _fragment_hash(batch->reads + f * batch->n_reads_frag, batch->n_reads_frag);
+	return RAPI_NO_ERROR;
+}
+
+/*
+ * Fill `dups` for the fragments in `batch`, already hashed, and mark the
+ * reads of the duplicates in `skip`.  The sequences are compared byte for
+ * byte, so fragments differing only in the case of their bases aren't
+ * collapsed.
+ */
+static int _find_duplicates(const rapi_batch* batch, dup_index* dups, uint8_t* skip, int* n_dups)
+{
+	const int n_frags = batch->n_frags;
+	const int n_reads_frag = batch->n_reads_frag;
+
+	int n_slots = 16;
+	while (n_slots < 2 * n_frags)
+		n_slots <<= 1;
+	if (n_slots > dups->n_slots) {
+		int* slots = realloc(dups->slots, n_slots * sizeof(int));
+		if (NULL == slots)
+			return RAPI_MEMORY_ERROR;
+		dups->slots = slots;
+		dups->n_slots = n_slots;
+	}
+	memset(dups->slots, 0xff, n_slots * sizeof(int));
+
+	*n_dups = 0;
+	for (int f = 0; f < n_frags; ++f) {
+		const rapi_read* reads = batch->reads + f * n_reads_frag;
+		const uint64_t h = dups->hashes[f];
+		dups->dup_of[f] = -1;
+		for (int s = h & (n_slots - 1); ; s = (s + 1) & (n_slots - 1)) {
+			const int g = dups->slots[s];
+			if (g < 0) {
+				dups->slots[s] = f;
+				break;
+			}
+			if (dups->hashes[g] == h && _same_fragment(batch->reads + g * n_reads_frag, reads, n_reads_frag)) {
+				dups->dup_of[f] = g;
+				memset(skip + f * n_reads_frag, SKIP_DUPLICATE, n_reads_frag);
+				*n_dups += 1;
+				break;
+			}
+		}
+	}
+	return RAPI_NO_ERROR;
+}
+
+/******** Alignment cache ********/
+
+#define CACHE_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+static inline void* _bump(char** buf, size_t size)
+{
+	void* p = *buf;
+	*buf += CACHE_ALIGN(size);
+	return p;
+}
+
+/* Bytes taken by _copy_alignments for the alignments of `read` */
+static size_t _alignments_size(const rapi_read* read)
+{
+	size_t size = CACHE_ALIGN(read->n_alignments * sizeof(rapi_alignment));
+	for (int i = 0; i < read->n_alignments; ++i) {
+		const rapi_alignment* aln = &read->alignments[i];
+		size += CACHE_ALIGN(aln->n_cigar_ops * sizeof(rapi_cigar));
+		size += CACHE_ALIGN(aln->tags.n * sizeof(rapi_tag));
+		for (size_t t = 0; t < aln->tags.n; ++t) {
+			if (aln->tags.a[t].type == RAPI_VTYPE_TEXT)
+				size += CACHE_ALIGN(aln->tags.a[t].value.text.l + 1);
+		}
+	}
+	return size;
+}
+
+/* Deep copy the alignments of `src` to `dst`, taking the space from *buf */
+static void _copy_alignments(rapi_read* dst, const rapi_read* src, char** buf)
+{
+	dst->n_alignments = src->n_alignments;
+	dst->alignments = src->n_alignments > 0 ? _bump(buf, src->n_alignments * sizeof(rapi_alignment)) : NULL;
+	for (int i = 0; i < src->n_alignments; ++i) {
+		rapi_alignment* aln = &dst->alignments[i];
+		*aln = src->alignments[i];
+		if (aln->n_cigar_ops > 0) {
+			aln->cigar_ops = _bump(buf, aln->n_cigar_ops * sizeof(rapi_cigar));
+			memcpy(aln->cigar_ops, src->alignments[i].cigar_ops, aln->n_cigar_ops * sizeof(rapi_cigar));
+		}
+		else
+			aln->cigar_ops = NULL;
+		if (aln->tags.n > 0) {
+			aln->tags.a = _bump(buf, aln->tags.n * sizeof(rapi_tag));
+			aln->tags.m = aln->tags.n;
+			memcpy(aln->tags.a, src->alignments[i].tags.a, aln->tags.n * sizeof(rapi_tag));
+			for (size_t t = 0; t < aln->tags.n; ++t) {
+				kstring_t* text = &aln->tags.a[t].value.text;
+				if (aln->tags.a[t].type != RAPI_VTYPE_TEXT)
+					continue;
+				char* s = _bump(buf, text->l + 1);
+				memcpy(s, text->s, text->l);
+				s[text->l] = '\0';
+				text->s = s;
+				text->m = text->l + 1;
+			}
+		}
+		else {
+			aln->tags.a = NULL;
+			aln->tags.n = aln->tags.m = 0;
+		}
+	}
+}
+
+static void _cache_unlink(aln_cache* cache, aln_cache_entry* e)
+{
+	if (e->newer) e->newer->older = e->older; else cache->newest = e->older;
+	if (e->older) e->older->newer = e->newer; else cache->oldest = e->newer;
+}
+
+static void _cache_push_newest(aln_cache* cache, aln_cache_entry* e)
+{
+	e->newer = NULL;
+	e->older = cache->newest;
+	if (cache->newest) cache->newest->newer = e; else cache->oldest = e;
+	cache->newest = e;
+}
+
+static void _cache_remove(aln_cache* cache, aln_cache_entry* e)
+{
+	aln_cache_entry** p = &cache->buckets[e->hash & (cache->n_buckets - 1)];
+	while (*p != e)
+		p = &(*p)->chain;
+	*p = e->chain;
+	_cache_unlink(cache, e);
+	cache->bytes -= e->size;
+	cache->n_entries -= 1;
+	free(e);
+}
+
+static void _cache_clear(aln_cache* cache)
+{
+	while (cache->oldest)
+		_cache_remove(cache, cache->oldest);
+}
+
+static aln_cache_entry* _cache_find(const aln_cache* cache, uint64_t hash, const rapi_read* reads, int n_reads)
+{
+	if (cache->n_buckets == 0)
+		return NULL;
+	for (aln_cache_entry* e = cache->buckets[hash & (cache->n_buckets - 1)]; e; e = e->chain) {
+		if (e->hash == hash && e->n_reads == n_reads && _same_fragment(e->reads, reads, n_reads))
+			return e;
+	}
+	return NULL;
+}
+
+/* Keep the number of buckets at least the number of entries */
+static int _cache_grow(aln_cache* cache)
+{
+	if (cache->n_entries < cache->n_buckets)
+		return RAPI_NO_ERROR;
+	const size_t n_buckets = cache->n_buckets ? 2 * cache->n_buckets : 1024;
+	aln_cache_entry** buckets = calloc(n_buckets, sizeof(aln_cache_entry*));
+	if (NULL == buckets)
 		return RAPI_MEMORY_ERROR;
+	for (size_t b = 0; b < cache->n_buckets; ++b) {
+		for (aln_cache_entry* e = cache->buckets[b], *next; e; e = next) {
+			next = e->chain;
+			e->chain = buckets[e->hash & (n_buckets - 1)];
+			buckets[e->hash & (n_buckets - 1)] = e;
+		}
 	}
+	free(cache->buckets);
+	cache->buckets = buckets;
+	cache->n_buckets = n_buckets;
+	return RAPI_NO_ERROR;
+}
 
-	for (int f = 0; f < batch->n_frags; ++f)
-	{
-		for (int r = 0; r < batch->n_reads_frag; ++r)
-		{
-			const rapi_read* rapi_read = rapi_get_read(batch, f, r);
-			bseq1_t* bwa_read = bwa_seqs->seqs + bwa_seqs->n_reads;
-
-			// -- In bseq1_t, all strings are null-terminated.
-			// We duplicated the seq and qual since BWA modifies them.
-			bwa_read->seq = strdup(rapi_read->seq);
-			bwa_read->qual = (NULL == rapi_read->qual) ? NULL : strdup(rapi_read->qual);
-			if (!bwa_read->seq || (!rapi_read->qual && bwa_read->qual))
-				goto failed_allocation;
-
-			bwa_read->name = rapi_read->id;
-			bwa_read->l_seq = rapi_read->length;
-			bwa_read->comment = NULL;
-			bwa_read->sam = NULL;
-
-			// As we build the objects n_reads keeps the actual number
-			// constructed thus far and thus can be used to free the allocated
-			// structres in case of error.
-			bwa_seqs->n_reads += 1;
-			bwa_seqs->n_bases += rapi_read->length;
+/*
+ * Store the alignments of a fragment, evicting the least recently used
+ * entries to make room.  Fragments that wouldn't fit are left out.
+ */
+static int _cache_put(aln_cache* cache, uint64_t hash, const rapi_read* reads, int n_reads)
+{
+	if (_cache_find(cache, hash, reads, n_reads))
+		return RAPI_NO_ERROR;
+
+	size_t size = sizeof(aln_cache_entry) + n_reads * sizeof(rapi_read);
+	for (int j = 0; j < n_reads; ++j)
+		size += CACHE_ALIGN(_read_seq_size(&reads[j])) + _alignments_size(&reads[j]);
+	if (size > cache->capacity)
+		return RAPI_NO_ERROR;
+
+	int error = _cache_grow(cache);
+	if (error)
+		return error;
+	aln_cache_entry* e = malloc(size);
+	if (NULL == e)
+		return RAPI_MEMORY_ERROR;
+	memset(e, 0, sizeof(aln_cache_entry) + n_reads * sizeof(rapi_read));
+	e->hash = hash;
+	e->size = size;
+	e->n_reads = n_reads;
+	char* buf = (char*)&e->reads[n_reads];
+	for (int j = 0; j < n_reads; ++j) {
+		const size_t seq_size = _read_seq_size(&reads[j]);
+		e->reads[j].length = reads[j].length;
+		e->reads[j].seq_packed = reads[j].seq_packed;
+		e->reads[j].seq = _bump(&buf, seq_size);
+		memcpy(e->reads[j].seq, reads[j].seq, seq_size);
+		_copy_alignments(&e->reads[j], &reads[j], &buf);
+	}
+
+	aln_cache_entry** bucket = &cache->buckets[hash & (cache->n_buckets - 1)];
+	e->chain = *bucket;
+	*bucket = e;
+	_cache_push_newest(cache, e);
+	cache->bytes += size;
+	cache->n_entries += 1;
+	while (cache->bytes > cache->capacity)
+		_cache_remove(cache, cache->oldest);
+	return RAPI_NO_ERROR;
+}
+
+/*
+ * Hash the BWA options that the alignments depend on, one field at a time
+ * as the structure has padding.  n_threads and chunk_size are left out.
+ */
+static uint64_t _hash_bwa_opts(uint64_t h, const mem_opt_t* opt)
+{
+#define HASH_FIELD(f) (h = _hash_bytes(h, &opt->f, sizeof(opt->f)))
+	HASH_FIELD(a); HASH_FIELD(b);
+	HASH_FIELD(o_del); HASH_FIELD(e_del);
+	HASH_FIELD(o_ins); HASH_FIELD(e_ins);
+	HASH_FIELD(pen_unpaired);
+	HASH_FIELD(pen_clip5); HASH_FIELD(pen_clip3);
+	HASH_FIELD(w);
+	HASH_FIELD(zdrop);
+	HASH_FIELD(T);
+	HASH_FIELD(flag);
+	HASH_FIELD(min_seed_len);
+	HASH_FIELD(split_factor);
+	HASH_FIELD(split_width);
+	HASH_FIELD(max_occ);
+	HASH_FIELD(max_chain_gap);
+	HASH_FIELD(mask_level);
+	HASH_FIELD(chain_drop_ratio);
+	HASH_FIELD(XA_drop_ratio);
+	HASH_FIELD(mask_level_redun);
+	HASH_FIELD(mapQ_coef_len);
+	HASH_FIELD(mapQ_coef_fac);
+	HASH_FIELD(max_ins);
+	HASH_FIELD(max_matesw);
+	HASH_FIELD(mat);
+#undef HASH_FIELD
+	return h;
+}
+
+/*
+ * Empty the cache unless its alignments were computed on the same index
+ * (not just the same rapi_ref, which may have been reloaded), with the same
+ * options and the same insert-size estimate `pes`.
+ */
+static void _cache_key(aln_cache* cache, const rapi_ref* ref, const rapi_opts* config,
+		const mem_opt_t* bwa_opt, const mem_pestat_t pes[4])
+{
+	uint64_t opts_hash = _hash_bwa_opts(config->exact_fast_path, bwa_opt);
+	for (int d = 0; d < 4; ++d) {
+		opts_hash = _hash_bytes(opts_hash, &pes[d].low, sizeof(pes[d].low));
+		opts_hash = _hash_bytes(opts_hash, &pes[d].high, sizeof(pes[d].high));
+		opts_hash = _hash_bytes(opts_hash, &pes[d].failed, sizeof(pes[d].failed));
+		opts_hash = _hash_bytes(opts_hash, &pes[d].avg, sizeof(pes[d].avg));
+		opts_hash = _hash_bytes(opts_hash, &pes[d].std, sizeof(pes[d].std));
+	}
+	const uint64_t generation = ((const bwa_ref*)ref->_private)->generation;
+
+	if (cache->ref_generation != generation || cache->contigs != ref->contigs || cache->opts_hash != opts_hash) {
+		_cache_clear(cache);
+		cache->ref_generation = generation;
+		cache->contigs = ref->contigs;
+		cache->opts_hash = opts_hash;
+	}
+}
+
+/*
+ * Look up the fragments of `batch` that aren't duplicates.  The hits get a
+ * copy of the cached alignments, allocated from lane 0 of `arena`, and
+ * their reads are marked SKIP_CACHED.
+ */
+static int _cache_lookup_batch(aln_cache* cache, rapi_batch* batch, rapi_arena* arena, const uint64_t* hashes, uint8_t* skip)
+{
+	const int n_reads_frag = batch->n_reads_frag;
+	for (int f = 0; f < batch->n_frags; ++f) {
+		if (skip[f * n_reads_frag] == SKIP_DUPLICATE)
+			continue;
+		rapi_read* reads = batch->reads + f * n_reads_frag;
+		aln_cache_entry* e = _cache_find(cache, hashes[f], reads, n_reads_frag);
+		if (NULL == e) {
+			cache->misses += 1;
+			continue;
 		}
+		cache->hits += 1;
+		_cache_unlink(cache, e);
+		_cache_push_newest(cache, e);
+
+		size_t size = 0;
+		for (int j = 0; j < n_reads_frag; ++j)
+			size += _alignments_size(&e->reads[j]);
+		char* buf = _arena_alloc(arena, 0, size);
+		if (NULL == buf)
+			return RAPI_MEMORY_ERROR;
+		for (int j = 0; j < n_reads_frag; ++j)
+			_copy_alignments(&reads[j], &e->reads[j], &buf);
+		memset(skip + f * n_reads_frag, SKIP_CACHED, n_reads_frag);
 	}
 	return RAPI_NO_ERROR;
+}
 
-failed_allocation:
-	fprintf(stderr, "Failed to allocate while constructing sequences! Freeing and returning\n");
-	_free_bwa_batch_contents(bwa_seqs);
-	return RAPI_MEMORY_ERROR;
+/* Store the fragments of `batch` that were aligned */
+static int _cache_store_batch(aln_cache* cache, const rapi_batch* batch, const uint64_t* hashes, const uint8_t* skip)
+{
+	const int n_reads_frag = batch->n_reads_frag;
+	for (int f = 0; f < batch->n_frags; ++f) {
+		if (skip[f * n_reads_frag] >= SKIP_DUPLICATE)
+			continue;
+		int error = _cache_put(cache, hashes[f], batch->reads + f * n_reads_frag, n_reads_frag);
+		if (error)
+			return error;
+	}
+	return RAPI_NO_ERROR;
 }
 
 /*
@@ -548,6 +1560,7 @@ static int _convert_opts(const rapi_opts* opts, mem_opt_t* bwa_opts)
 {
 	bwa_opts->T = opts->mapq_min;
 	bwa_opts->max_ins = opts->isize_max;
+	bwa_opts->n_threads = opts->n_threads;
 
 	// TODO: other options provided through 'parameters' field
 	return RAPI_NO_ERROR;
@@ -559,11 +1572,62 @@ int rapi_aligner_state_init(const rapi_opts* opts, struct rapi_aligner_state** r
 	rapi_aligner_state* state = *ret_state = calloc(1, sizeof(rapi_aligner_state));
 	if (NULL == state)
 		return RAPI_MEMORY_ERROR;
+
+	int error = _pool_init(&state->pool, opts->n_threads, opts->pin_threads);
+	if (!error && opts->sa_cache_bytes > 0)
+		error = rapi_bwa_sa_cache_init(&state->sa_cache, opts->sa_cache_bytes);
+	if (error) {
+		_pool_destroy(state->pool);
+		free(state);
+		*ret_state = NULL;
+		return error;
+	}
+	state->cache.capacity = opts->aln_cache_bytes;
+	rapi_bwa_pestat_init(&state->pestat);
+	pthread_mutex_init(&state->align_lock, NULL);
+	pthread_mutex_init(&state->queue_lock, NULL);
+	pthread_cond_init(&state->queue_cond, NULL);
+	pthread_cond_init(&state->idle_cond, NULL);
 	return RAPI_NO_ERROR;
 }
 
+/* Whether the calling thread is the dispatcher, i.e., we're in a callback */
+static int _in_dispatcher(const rapi_aligner_state* state)
+{
+	return state->dispatcher_running && pthread_equal(pthread_self(), state->dispatcher);
+}
+
 int rapi_aligner_state_free(rapi_aligner_state* state)
 {
+	// the dispatcher can't join itself
+	if (_in_dispatcher(state))
+		return RAPI_OP_NOT_SUPPORTED_ERROR;
+
+	// let any queued batches complete, then stop the dispatcher
+	rapi_aligner_state_wait(state);
+	pthread_mutex_lock(&state->queue_lock);
+	state->shutdown = 1;
+	pthread_cond_signal(&state->queue_cond);
+	pthread_mutex_unlock(&state->queue_lock);
+	if (state->dispatcher_running)
+		pthread_join(state->dispatcher, NULL);
+
+	pthread_cond_destroy(&state->idle_cond);
+	pthread_cond_destroy(&state->queue_cond);
+	pthread_mutex_destroy(&state->queue_lock);
+	pthread_mutex_destroy(&state->align_lock);
+	_pool_destroy(state->pool);
+	_free_bwa_batch(&state->bwa_seqs);
+	free(state->regs);
+	free(state->skip);
+	free(state->frag_order);
+	free(state->dups.hashes);
+	free(state->dups.dup_of);
+	free(state->dups.slots);
+	_cache_clear(&state->cache);
+	free(state->cache.buckets);
+	rapi_bwa_sa_cache_free(state->sa_cache);
+	rapi_bwa_pestat_free(&state->pestat);
 	free(state);
 	return RAPI_NO_ERROR;
 }
@@ -617,14 +1681,14 @@ extern mem_alnreg_v mem_align1_core(const mem_opt_t *opt, const bwt_t *bwt, cons
 void mem_mark_primary_se(const mem_opt_t *opt, int n, mem_alnreg_t *a, int64_t id);
 
 /* based on mem_aln2sam */
-static int _bwa_aln_to_rapi_aln(const rapi_ref* rapi_ref, rapi_read* our_read, int is_paired,
+static int _bwa_aln_to_rapi_aln(const rapi_ref* rapi_ref, rapi_arena* arena, int tid, rapi_read* our_read, int is_paired,
 		const bseq1_t *s,
 		const mem_aln_t *const bwa_aln_list, int list_length)
 {
 	if (list_length < 0)
 		return RAPI_PARAM_ERROR;
 
-	our_read->alignments = calloc(list_length, sizeof(rapi_alignment));
+	our_read->alignments = _arena_calloc(arena, tid, list_length, sizeof(rapi_alignment));
 	if (NULL == our_read->alignments)
 		return RAPI_MEMORY_ERROR;
 	our_read->n_alignments = list_length;
@@ -636,7 +1700,6 @@ static int _bwa_aln_to_rapi_aln(const rapi_ref* rapi_ref, rapi_read* our_read, i
 
 		if (bwa_aln->rid >= rapi_ref->n_contigs) { // huh?? Out of bounds
 			fprintf(stderr, "read reference id value %d is out of bounds (n_contigs: %d)\n", bwa_aln->rid, rapi_ref->n_contigs);
-			free(our_read->alignments);
 			our_read->alignments = NULL; our_read->n_alignments = 0;
 			return RAPI_GENERIC_ERROR;
 		}
@@ -658,7 +1721,7 @@ static int _bwa_aln_to_rapi_aln(const rapi_ref* rapi_ref, rapi_read* our_read, i
 			our_aln->pos = bwa_aln->pos + 1;
 			our_aln->n_mismatches = bwa_aln->NM;
 			if (bwa_aln->n_cigar) { // aligned
-				our_aln->cigar_ops = malloc(bwa_aln->n_cigar * sizeof(our_aln->cigar_ops[0]));
+				our_aln->cigar_ops = _arena_alloc(arena, tid, bwa_aln->n_cigar * sizeof(our_aln->cigar_ops[0]));
 				if (NULL == our_aln->cigar_ops)
 					err_fatal(__func__, "Failed to allocate cigar space");
 				our_aln->n_cigar_ops = bwa_aln->n_cigar;
@@ -669,13 +1732,21 @@ static int _bwa_aln_to_rapi_aln(const rapi_ref* rapi_ref, rapi_read* our_read, i
 			}
 		}
 
-		rapi_tag tag;
-
+		// The tag vector and the text payloads are allocated from the arena
+		// with exactly the space required (i.e., tags.m == tags.n).
 		if (bwa_aln->sub >= 0) {
-			rapi_tag_set_key(&tag, "XS");
-			rapi_tag_set_text(&tag, "");
-			kputw(bwa_aln->sub, &tag.value.text);
-			kv_push(rapi_tag, our_aln->tags, tag);
+			rapi_tag* tag = _arena_calloc(arena, tid, 1, sizeof(rapi_tag));
+			char buf[16];
+			int len = snprintf(buf, sizeof(buf), "%d", bwa_aln->sub);
+			char* text = _arena_strndup(arena, tid, buf, len);
+			if (NULL == tag || NULL == text)
+				return RAPI_MEMORY_ERROR;
+			rapi_tag_set_key(tag, "XS");
+			tag->type = RAPI_VTYPE_TEXT;
+			tag->value.text.s = text;
+			tag->value.text.l = tag->value.text.m = len;
+			our_aln->tags.a = tag;
+			our_aln->tags.n = our_aln->tags.m = 1;
 		}
 
 		// TODO: extra tags
@@ -711,11 +1782,11 @@ static int _bwa_aln_to_rapi_aln(const rapi_ref* rapi_ref, rapi_read* our_read, i
  * We took out the call to mem_aln2sam and instead write the result to
  * the corresponding rapi_read structure.
  */
-static int _bwa_reg2_rapi_aln_se(const mem_opt_t *opt, const rapi_ref* rapi_ref, rapi_read* our_read, bseq1_t *seq, mem_alnreg_v *a, int extra_flag, const mem_aln_t *m)
+static int _bwa_reg2_rapi_aln_se(const mem_opt_t *opt, const rapi_ref* rapi_ref, rapi_arena* arena, int tid, rapi_read* our_read, bseq1_t *seq, mem_alnreg_v *a, int extra_flag, const mem_aln_t *m)
 {
 	int error = RAPI_NO_ERROR;
-	const bntseq_t *const bns = ((bwaidx_t*)rapi_ref->_private)->bns;
-	const uint8_t *const pac = ((bwaidx_t*)rapi_ref->_private)->pac;
+	const bntseq_t *const bns = _ref_idx(rapi_ref)->bns;
+	const uint8_t *const pac = _ref_idx(rapi_ref)->pac;
 
 	kvec_t(mem_aln_t) aa;
 	int k;
@@ -740,10 +1811,10 @@ static int _bwa_reg2_rapi_aln_se(const mem_opt_t *opt, const rapi_ref* rapi_ref,
 		t = mem_reg2aln(opt, bns, pac, seq->l_seq, seq->seq, 0);
 		t.flag |= extra_flag;
 		// RAPI
-		error = _bwa_aln_to_rapi_aln(rapi_ref, our_read, 0, seq, &t, 1);
+		error = _bwa_aln_to_rapi_aln(rapi_ref, arena, tid, our_read, 0, seq, &t, 1);
 	}
 	else {
-		error = _bwa_aln_to_rapi_aln(rapi_ref, our_read, /* unpaired */ 0, seq, /* list of aln */ aa.a, aa.n);
+		error = _bwa_aln_to_rapi_aln(rapi_ref, arena, tid, our_read, /* unpaired */ 0, seq, /* list of aln */ aa.a, aa.n);
 	}
 
 	if (aa.n > 0)
@@ -761,7 +1832,7 @@ static int _bwa_reg2_rapi_aln_se(const mem_opt_t *opt, const rapi_ref* rapi_ref,
 /*
  * Mostly taken from mem_sam_pe in bwamem_pair.c
  */
-int _bwa_mem_pe(const mem_opt_t *opt, const rapi_ref* rapi_ref, const mem_pestat_t pes[4], uint64_t id, bseq1_t s[2], mem_alnreg_v a[2], rapi_read out[2])
+int _bwa_mem_pe(const mem_opt_t *opt, const rapi_ref* rapi_ref, rapi_arena* arena, int tid, const mem_pestat_t pes[4], uint64_t id, bseq1_t s[2], mem_alnreg_v a[2], rapi_read out[2])
 {
 	// functions defined in bwamem.c or bwamem_pair.c
 	extern void mem_mark_primary_se(const mem_opt_t *opt, int n, mem_alnreg_t *a, int64_t id);
@@ -769,8 +1840,8 @@ int _bwa_mem_pe(const mem_opt_t *opt, const rapi_ref* rapi_ref, const mem_pestat
 	extern int mem_matesw(const mem_opt_t *opt, int64_t l_pac, const uint8_t *pac, const mem_pestat_t pes[4], const mem_alnreg_t *a, int l_ms, const uint8_t *ms, mem_alnreg_v *ma);
 	extern int mem_pair(const mem_opt_t *opt, int64_t l_pac, const uint8_t *pac, const mem_pestat_t pes[4], bseq1_t s[2], mem_alnreg_v a[2], int id, int *sub, int *n_sub, int z[2]);
 
-	const bntseq_t *const bns = ((bwaidx_t*)rapi_ref->_private)->bns;
-	const uint8_t *const pac = ((bwaidx_t*)rapi_ref->_private)->pac;
+	const bntseq_t *const bns = _ref_idx(rapi_ref)->bns;
+	const uint8_t *const pac = _ref_idx(rapi_ref)->pac;
 
 	int n = 0, i, j, z[2], o, subo, n_sub, extra_flag = 1;
 	kstring_t str;
@@ -836,8 +1907,8 @@ int _bwa_mem_pe(const mem_opt_t *opt, const rapi_ref* rapi_ref, const mem_pestat
 		h[1] = mem_reg2aln(opt, bns, pac, s[1].l_seq, s[1].seq, &a[1].a[z[1]]); h[1].mapq = q_se[1]; h[1].flag |= 0x80 | extra_flag;
 		// RAPI: instead of writing sam, convert mem_aln_t into our alignments
 		// XXX: I'm not so sure the alignment I'm passing in.  Review
-		int error1 = _bwa_aln_to_rapi_aln(rapi_ref, &out[0], 1, &s[0], &h[0], 1);
-		int error2 = _bwa_aln_to_rapi_aln(rapi_ref, &out[1], 1, &s[1], &h[1], 1);
+		int error1 = _bwa_aln_to_rapi_aln(rapi_ref, arena, tid, &out[0], 1, &s[0], &h[0], 1);
+		int error2 = _bwa_aln_to_rapi_aln(rapi_ref, arena, tid, &out[1], 1, &s[1], &h[1], 1);
 		if (error1 || error2) {
 			err_fatal(__func__, "error %d while converting BWA mem_aln_t for read %d into rapi alignments\n", (error1 ? 1 : 2), (error1 ? error1 : error2));
 			abort();
@@ -864,8 +1935,8 @@ no_pairing:
 	h[0].flag |= 0x41|extra_flag;
 	h[1].flag |= 0x81|extra_flag;
 
-	int error1 = _bwa_reg2_rapi_aln_se(opt, rapi_ref, &out[0], &s[0], &a[0], 0x41|extra_flag, &h[1]);
-	int error2 = _bwa_reg2_rapi_aln_se(opt, rapi_ref, &out[1], &s[1], &a[1], 0x81|extra_flag, &h[0]);
+	int error1 = _bwa_reg2_rapi_aln_se(opt, rapi_ref, arena, tid, &out[0], &s[0], &a[0], 0x41|extra_flag, &h[1]);
+	int error2 = _bwa_reg2_rapi_aln_se(opt, rapi_ref, arena, tid, &out[1], &s[1], &a[1], 0x81|extra_flag, &h[0]);
 	if (error1 || error2) {
 		err_fatal(__func__, "error %d while converting *with no pairing* BWA mem_aln_t for read %d into rapi alignments\n", (error1 ? 1 : 2), (error1 ? error1 : error2));
 		abort();
@@ -881,45 +1952,140 @@ typedef struct {
 	const rapi_ref* rapi_ref;
 	const bwa_batch* read_batch;
 	rapi_read* rapi_reads; // need to pass these along because the code to convert BWA alignments into rapi is nested pretty deep
+	rapi_arena* arena;     // where the rapi alignments are allocated;  each thread uses its own lane
+	const worker_pool* pool;
 	mem_pestat_t *pes;
 	mem_alnreg_v *regs;
+	uint8_t *skip;       // per read, one of SKIP_*
+	const int *dup_of;   // per fragment;  NULL unless collapsing duplicates
+	int exact_fast_path;
+	sa_cache* sa_cache;
+	const uint64_t *order; // order of the fragments in the second stage (low 32 bits);  NULL for batch order
 	int64_t n_processed;
 } bwa_worker_t;
 
 /*
- * This function is the same as worker1 from bwamem.c
+ * Reads in each work item of the first stage.  A multiple of
+ * SEED_GROUP_SIZE, so that the seeding has enough reads to interleave.
+ */
+#define SEED_ITEM_READS (4 * SEED_GROUP_SIZE)
+
+/*
+ * Like worker1 from bwamem.c, but on SEED_ITEM_READS reads at a time
+ * (single or paired, it doesn't matter here), since rapi_bwa_align_core
+ * seeds several reads together.
  */
 static void bwa_worker_1(void *data, int i, int tid)
 {
 	bwa_worker_t *w = (bwa_worker_t*)data;
 
-	const bwaidx_t* const bwaidx = (bwaidx_t*)(w->rapi_ref->_private);
-	const bwt_t*    const bwt    = bwaidx->bwt;
-	const bntseq_t* const bns    = bwaidx->bns;
-	const uint8_t*  const pac    = bwaidx->pac;
+	// the FM-index lookups are done on the copy of the index nearest to the
+	// thread, if the reference was loaded with RAPI_REF_LOAD_NUMA
+	const bwa_ref* const ref = w->rapi_ref->_private;
+	const bwaidx_t* const bwaidx = ref->n_replicas > 0 ? _ref_idx_node(w->rapi_ref, _pool_thread_node(w->pool, tid)) : ref->idx;
+
+	const int begin = i * SEED_ITEM_READS;
+	const int end = begin + SEED_ITEM_READS < w->read_batch->n_reads ? begin + SEED_ITEM_READS : w->read_batch->n_reads;
+	for (int r = begin; r < end; ++r) {
+		if (w->skip[r] >= SKIP_DUPLICATE)
+			kv_init(w->regs[r]); // aligned with its first copy or cached
+		else
+			_load_bwa_seq(&w->read_batch->seqs[r], &w->rapi_reads[r]);
+	}
+
+	if (w->exact_fast_path) {
+		// keeps only the unique full-length region of the read.  Unlike
+		// mem_align1_core, it doesn't reseed long SMEMs, so suboptimal hits
+		// (and with them sub and csub) may be missed.
+		for (int r = begin; r < end; ++r) {
+			mem_alnreg_t reg;
+			if (w->skip[r] == SKIP_NONE && rapi_bwa_exact_hit(w->opt, bwaidx, &w->read_batch->seqs[r], &reg)) {
+				w->skip[r] = SKIP_EXACT_HIT;
+				kv_init(w->regs[r]);
+				kv_push(mem_alnreg_t, w->regs[r], reg);
+			}
+		}
+	}
+	rapi_bwa_align_core(w->opt, bwaidx, end - begin, &w->read_batch->seqs[begin], &w->regs[begin], &w->skip[begin], w->sa_cache);
+}
+
+/*
+ * The alignment of a read found by the exact-match fast path:  the
+ * full-length match of its only region, without going through mem_reg2aln.
+ * Its one CIGAR operation is written to *cigar.
+ */
+static mem_aln_t _exact_hit_aln(const bntseq_t* bns, const bseq1_t* seq, const mem_alnreg_t* reg, uint32_t* cigar)
+{
+	mem_aln_t a;
+	memset(&a, 0, sizeof(a));
+	*cigar = (uint32_t)seq->l_seq << 4; // M
+
+	int is_rev;
+	int64_t pos = bns_depos(bns, reg->rb < bns->l_pac ? reg->rb : reg->re - 1, &is_rev);
+	a.rid = bns_pos2rid(bns, pos);
+	a.pos = pos - bns->anns[a.rid].offset;
+	a.is_rev = is_rev;
+	a.flag = is_rev ? 0x10 : 0;
+	a.mapq = 60;
+	a.NM = 0;
+	a.score = reg->score;
+	a.sub = reg->sub > reg->csub ? reg->sub : reg->csub;
+	a.n_cigar = 1;
+	a.cigar = cigar;
+	return a;
+}
+
+/*
+ * Emit a pair whose mates were both found by the fast path.  There's
+ * nothing to rescue, but the mates are checked and flagged as in the
+ * no_pairing case of _bwa_mem_pe.
+ */
+static int _exact_pair_to_rapi_aln(const mem_opt_t *opt, const rapi_ref* rapi_ref, rapi_arena* arena, int tid,
+		const mem_pestat_t pes[4], const bseq1_t s[2], const mem_alnreg_v a[2], rapi_read out[2])
+{
+	const bntseq_t *const bns = _ref_idx(rapi_ref)->bns;
+	if (strcmp(s[0].name, s[1].name) != 0) err_fatal(__func__, "paired reads have different names: \"%s\", \"%s\"\n", s[0].name, s[1].name);
+
+	uint32_t cigar[2];
+	mem_aln_t h[2];
+	for (int i = 0; i < 2; ++i)
+		h[i] = _exact_hit_aln(bns, &s[i], &a[i].a[0], &cigar[i]);
 
-	fprintf(stderr, "bwa_worker_1: MEM_F_PE is %sset\n", ((w->opt->flag & MEM_F_PE) == 0 ? "not " : " "));
-	if (w->opt->flag & MEM_F_PE) {
-		int read = 2*i;
-		int mate = 2*i + 1;
-		w->regs[read] = mem_align1_core(w->opt, bwt, bns, pac, w->read_batch->seqs[read].l_seq, w->read_batch->seqs[read].seq);
-		w->regs[mate] = mem_align1_core(w->opt, bwt, bns, pac, w->read_batch->seqs[mate].l_seq, w->read_batch->seqs[mate].seq);
-	} else {
-		w->regs[i] = mem_align1_core(w->opt, bwt, bns, pac, w->read_batch->seqs[i].l_seq, w->read_batch->seqs[i].seq);
+	int extra_flag = 1;
+	if (!(opt->flag & MEM_F_NOPAIRING) && h[0].rid == h[1].rid) { // if the two hits constitute a proper pair, flag it.
+		int64_t dist;
+		int d = mem_infer_dir(bns->l_pac, a[0].a[0].rb, a[1].a[0].rb, &dist);
+		if (!pes[d].failed && dist >= pes[d].low && dist <= pes[d].high) extra_flag |= 2;
 	}
+	h[0].flag |= 0x40 | extra_flag;
+	h[1].flag |= 0x80 | extra_flag;
+
+	const int is_paired = (extra_flag & 2) != 0;
+	int error = _bwa_aln_to_rapi_aln(rapi_ref, arena, tid, &out[0], is_paired, &s[0], &h[0], 1);
+	if (!error)
+		error = _bwa_aln_to_rapi_aln(rapi_ref, arena, tid, &out[1], is_paired, &s[1], &h[1], 1);
+	return error;
 }
 
 /* based on worker2 from bwamem.c */
 static void bwa_worker_2(void *data, int i, int tid)
 {
 	bwa_worker_t *w = (bwa_worker_t*)data;
-	fprintf(stderr, "bwa_worker_2 with i %d\n", i);
+	if (w->order)
+		i = (uint32_t)w->order[i];
 	int error = RAPI_NO_ERROR;
 
-	if ((w->opt->flag & MEM_F_PE)) {
+	if (w->skip[i * w->read_batch->n_reads_per_frag] >= SKIP_DUPLICATE)
+		return; // see _copy_duplicate and _cache_lookup_batch
+
+	if ((w->opt->flag & MEM_F_PE) && w->skip[2 * i] == SKIP_EXACT_HIT && w->skip[2 * i + 1] == SKIP_EXACT_HIT) {
+		error = _exact_pair_to_rapi_aln(w->opt, w->rapi_ref, w->arena, tid, w->pes, &w->read_batch->seqs[2 * i], &w->regs[2 * i], &w->rapi_reads[2 * i]);
+		free(w->regs[2 * i].a); free(w->regs[2 * i + 1].a);
+	}
+	else if ((w->opt->flag & MEM_F_PE)) {
 		// paired end
 		//mem_sam_pe(w->opt, w->bns, w->pac, w->pes, (w->n_processed>>1) + i, &w->seqs[i<<1], &w->regs[i<<1]);
-		error = _bwa_mem_pe(w->opt, w->rapi_ref, w->pes, w->n_processed / 2 + i, &(w->read_batch->seqs[2 * i]), &w->regs[2 * i], &(w->rapi_reads[2 * i]));
+		error = _bwa_mem_pe(w->opt, w->rapi_ref, w->arena, tid, w->pes, w->n_processed / 2 + i, &(w->read_batch->seqs[2 * i]), &w->regs[2 * i], &(w->rapi_reads[2 * i]));
 		free(w->regs[2 * i].a); free(w->regs[2 * i + 1].a);
 	}
 	else {
@@ -934,10 +2100,65 @@ static void bwa_worker_2(void *data, int i, int tid)
 		err_fatal(__func__, "error %d while running %s end alignments\n", error, ((w->opt->flag & MEM_F_PE) ? "pair" : "single"));
 }
 
+/*
+ * Give duplicate fragment i the alignments of its first copy.  The copies
+ * share the CIGARs and tags, which are in the batch's arena as well.
+ */
+static void _copy_duplicate(void *data, int i, int tid)
+{
+	bwa_worker_t *w = (bwa_worker_t*)data;
+	if (w->dup_of[i] < 0)
+		return;
+
+	const int n_reads_frag = w->read_batch->n_reads_per_frag;
+	for (int j = 0; j < n_reads_frag; ++j) {
+		const rapi_read* src = &w->rapi_reads[w->dup_of[i] * n_reads_frag + j];
+		rapi_read* dst = &w->rapi_reads[i * n_reads_frag + j];
+		dst->n_alignments = src->n_alignments;
+		if (src->n_alignments == 0) {
+			dst->alignments = NULL;
+			continue;
+		}
+		dst->alignments = _arena_alloc(w->arena, tid, src->n_alignments * sizeof(rapi_alignment));
+		if (NULL == dst->alignments)
+			err_fatal(__func__, "Failed to allocate alignment space");
+		memcpy(dst->alignments, src->alignments, src->n_alignments * sizeof(rapi_alignment));
+	}
+}
+
 #endif
 /********** end modified BWA code *****************/
 
-int rapi_align_reads( const rapi_ref* ref,  rapi_batch * batch, const rapi_opts * config, rapi_aligner_state* state )
+static int _cost_cmp(const void* a, const void* b)
+{
+	const uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return x < y ? 1 : (x > y ? -1 : 0); // descending
+}
+
+/*
+ * Order the fragments for the second stage by decreasing estimated cost,
+ * so that the expensive ones don't end up as stragglers.  The cost of a
+ * read is taken as its length times the number of its regions, since each
+ * region is extended into an alignment and used for mate rescue.
+ */
+static void _order_by_cost(const bwa_batch* bwa_seqs, const mem_alnreg_v* regs, const uint8_t* skip, uint64_t* order)
+{
+	const int n_reads_frag = bwa_seqs->n_reads_per_frag;
+	const int n_frags = bwa_seqs->n_reads / n_reads_frag;
+	for (int f = 0; f < n_frags; ++f) {
+		uint64_t cost = 0;
+		for (int r = f * n_reads_frag; r < (f + 1) * n_reads_frag; ++r) {
+			if (skip[r] < SKIP_DUPLICATE)
+				cost += (uint64_t)bwa_seqs->seqs[r].l_seq * (1 + regs[r].n);
+		}
+		if (cost > UINT32_MAX)
+			cost = UINT32_MAX;
+		order[f] = cost << 32 | (uint32_t)f;
+	}
+	qsort(order, n_frags, sizeof(uint64_t), _cost_cmp);
+}
+
+static int _align_reads( const rapi_ref* ref,  rapi_batch * batch, const rapi_opts * config, rapi_aligner_state* state )
 {
 	int error = RAPI_NO_ERROR;
 
@@ -947,6 +2168,10 @@ int rapi_align_reads( const rapi_ref* ref,  rapi_batch * batch, const rapi_opts
 	if (batch->n_reads_frag <= 0)
 		return RAPI_PARAM_ERROR;
 
+	// the reference may still be loading in the background
+	if ((error = rapi_bwa_ref_wait(ref->_private)))
+		return error;
+
 	// "extract" BWA-specific structures
 	mem_opt_t*const bwa_opt = (mem_opt_t*) config->_private;
 
@@ -955,56 +2180,258 @@ int rapi_align_reads( const rapi_ref* ref,  rapi_batch * batch, const rapi_opts
 
 	if ((error = _convert_opts(config, bwa_opt)))
 		return error;
-	fprintf(stderr, "opts converted\n");
 
-	// traslate our read structure into BWA reads
-	bwa_batch bwa_seqs;
-	if ((error = _batch_to_bwa_seq(batch, config, &bwa_seqs)))
+	// each worker thread allocates alignments from its own lane of the batch's arena
+	rapi_arena* arena = _batch_arena(batch);
+	if (NULL == arena)
+		return RAPI_MEMORY_ERROR;
+	if ((error = _arena_reserve_lanes(arena, state->pool->n_threads)))
 		return error;
-	fprintf(stderr, "converted reads to BWA structures.\n");
 
-	_print_bwa_batch(stderr, &bwa_seqs);
+	// traslate our read structure into BWA reads
+	bwa_batch*const bwa_seqs = &state->bwa_seqs;
+	if ((error = _batch_to_bwa_seq(batch, config, bwa_seqs)))
+		return error;
 
-	fprintf(stderr, "Going to process.\n");
-	mem_alnreg_v *regs = malloc(bwa_seqs.n_reads * sizeof(mem_alnreg_v));
-	if (NULL == regs) {
-		error = RAPI_MEMORY_ERROR;
-		goto clean_up;
+	if (bwa_seqs->n_reads > state->regs_capacity) {
+		mem_alnreg_v* regs = realloc(state->regs, bwa_seqs->n_reads * sizeof(mem_alnreg_v));
+		if (NULL == regs)
+			return RAPI_MEMORY_ERROR;
+		state->regs = regs;
+		uint8_t* skip = realloc(state->skip, bwa_seqs->n_reads);
+		if (NULL == skip)
+			return RAPI_MEMORY_ERROR;
+		state->skip = skip;
+		uint64_t* frag_order = realloc(state->frag_order, bwa_seqs->n_reads * sizeof(uint64_t));
+		if (NULL == frag_order)
+			return RAPI_MEMORY_ERROR;
+		state->frag_order = frag_order;
+		state->regs_capacity = bwa_seqs->n_reads;
 	}
-	fprintf(stderr, "Allocated %d mem_alnreg_v structures\n", bwa_seqs.n_reads);
+	mem_alnreg_v *regs = state->regs;
+
+	memset(state->skip, SKIP_NONE, bwa_seqs->n_reads);
+	int n_dups = 0;
+	// single-end batches emit no alignments, so only pairs are cached, and
+	// only once the insert-size estimate they depend on has stopped changing
+	const int is_pe = (bwa_opt->flag & MEM_F_PE) != 0;
+	const int use_cache = state->cache.capacity > 0 && is_pe && state->pestat.frozen;
+	if (use_cache)
+		_cache_key(&state->cache, ref, config, bwa_opt, state->pestat.pes);
+	if ((config->collapse_duplicates || use_cache) && (error = _hash_fragments(batch, &state->dups)))
+		return error;
+	if (config->collapse_duplicates && (error = _find_duplicates(batch, &state->dups, state->skip, &n_dups)))
+		return error;
+	if (use_cache && (error = _cache_lookup_batch(&state->cache, batch, arena, state->dups.hashes, state->skip)))
+		return error;
 
-	extern void kt_for(int n_threads, void (*func)(void*,int,int), void *data, int n);
 	bwa_worker_t w;
 	w.opt = bwa_opt;
-	w.read_batch = &bwa_seqs;
+	w.read_batch = bwa_seqs;
 	w.regs = regs;
-	w.pes = state->pes;
+	w.skip = state->skip;
+	w.dup_of = n_dups > 0 ? state->dups.dup_of : NULL;
+	// single-end alignments aren't emitted yet, so the fast path would be
+	// the only source of them
+	w.exact_fast_path = config->exact_fast_path && (bwa_opt->flag & MEM_F_PE);
+	w.sa_cache = state->sa_cache;
+	w.order = NULL;
+	const bwa_ref* const idx_ref = ref->_private;
+	if (state->sa_cache && state->sa_cache_generation != idx_ref->generation) {
+		rapi_bwa_sa_cache_clear(state->sa_cache);
+		state->sa_cache_generation = idx_ref->generation;
+	}
+	w.pes = state->pestat.pes;
 	w.n_processed = state->n_reads_processed;
 	w.rapi_ref = ref;
 	w.rapi_reads = batch->reads;
-
-	fprintf(stderr, "Calling bwa_worker_1. bwa_opt->flag: %d\n", bwa_opt->flag);
-	int n_fragments = (bwa_opt->flag & MEM_F_PE) ? bwa_seqs.n_reads / 2 : bwa_seqs.n_reads;
-	kt_for(bwa_opt->n_threads, bwa_worker_1, &w, n_fragments); // find mapping positions
-
-	if (bwa_opt->flag & MEM_F_PE) { // infer insert sizes if not provided
-		// TODO: support manually setting insert size dist parameters
-		// if (pes0) memcpy(pes, pes0, 4 * sizeof(mem_pestat_t)); // if pes0 != NULL, set the insert-size distribution as pes0
-		mem_pestat(bwa_opt, ((bwaidx_t*)ref->_private)->bns->l_pac, bwa_seqs.n_reads, regs, w.pes); // infer the insert size distribution from data
+	w.arena = arena;
+	w.pool = state->pool;
+
+	int n_fragments = (bwa_opt->flag & MEM_F_PE) ? bwa_seqs->n_reads / 2 : bwa_seqs->n_reads;
+	_pool_for(state->pool, bwa_worker_1, &w, (bwa_seqs->n_reads + SEED_ITEM_READS - 1) / SEED_ITEM_READS,
+			config->sched_chunk / SEED_ITEM_READS); // find mapping positions
+
+	if (bwa_opt->flag & MEM_F_PE) { // update the insert-size distribution with this batch, unless frozen
+		if ((error = rapi_bwa_pestat_update(&state->pestat, bwa_opt, _ref_idx(ref)->bns->l_pac, bwa_seqs->n_reads, regs))) {
+			for (int r = 0; r < bwa_seqs->n_reads; ++r)
+				free(regs[r].a); // bwa_worker_2 would have freed them
+			return error;
+		}
+	}
+	if (config->sched_cost_order && state->pool->n_threads > 1) {
+		_order_by_cost(bwa_seqs, regs, state->skip, state->frag_order);
+		w.order = state->frag_order;
 	}
-	kt_for(bwa_opt->n_threads, bwa_worker_2, &w, n_fragments); // generate alignment
+	_pool_for(state->pool, bwa_worker_2, &w, n_fragments, config->sched_chunk / bwa_seqs->n_reads_per_frag); // generate alignment
+	if (use_cache && (error = _cache_store_batch(&state->cache, batch, state->dups.hashes, state->skip)))
+		return error;
+	if (n_dups > 0)
+		_pool_for(state->pool, _copy_duplicate, &w, n_fragments, 256);
 
 	// run the alignment
-	state->n_reads_processed += bwa_seqs.n_reads;
-	fprintf(stderr, "processed %lld reads\n", state->n_reads_processed);
+	state->n_reads_processed += bwa_seqs->n_reads;
 
-clean_up:
-	free(regs);
-	_free_bwa_batch_contents(&bwa_seqs);
+	return error;
+}
 
+int rapi_align_reads( const rapi_ref* ref,  rapi_batch * batch, const rapi_opts * config, rapi_aligner_state* state )
+{
+	pthread_mutex_lock(&state->align_lock);
+	int error = _align_reads(ref, batch, config, state);
+	pthread_mutex_unlock(&state->align_lock);
 	return error;
 }
 
+/*
+ * Align a batch taken off the queue and call its callback.  Called without
+ * queue_lock.
+ */
+static void _run_job(rapi_aligner_state* state, align_job* job)
+{
+	int error = rapi_align_reads(job->ref, job->batch, job->config, state);
+	if (job->callback)
+		job->callback(job->batch, error, job->user_data);
+	free(job);
+
+	pthread_mutex_lock(&state->queue_lock);
+	if (--state->n_jobs == 0)
+		pthread_cond_broadcast(&state->idle_cond);
+	pthread_mutex_unlock(&state->queue_lock);
+}
+
+/* Take the next job off the queue, or NULL if it's empty.  Called with queue_lock. */
+static align_job* _pop_job(rapi_aligner_state* state)
+{
+	align_job* job = state->queue_head;
+	if (job) {
+		state->queue_head = job->next;
+		if (NULL == state->queue_head)
+			state->queue_tail = NULL;
+	}
+	return job;
+}
+
+/*
+ * Body of the thread that aligns the batches queued by rapi_align_reads_async.
+ */
+static void* _align_dispatcher(void* arg)
+{
+	rapi_aligner_state* state = (rapi_aligner_state*)arg;
+
+	pthread_mutex_lock(&state->queue_lock);
+	while (1) {
+		while (!state->shutdown && NULL == state->queue_head)
+			pthread_cond_wait(&state->queue_cond, &state->queue_lock);
+		if (NULL == state->queue_head) // shutting down and nothing left to do
+			break;
+
+		align_job* job = _pop_job(state);
+		pthread_mutex_unlock(&state->queue_lock);
+
+		_run_job(state, job);
+		pthread_mutex_lock(&state->queue_lock);
+	}
+	pthread_mutex_unlock(&state->queue_lock);
+	return NULL;
+}
+
+int rapi_align_reads_async( const rapi_ref* ref,  rapi_batch * batch, const rapi_opts * config, rapi_aligner_state* state,
+                            rapi_align_callback callback, void* user_data )
+{
+	if (NULL == ref || NULL == batch || NULL == config || NULL == state)
+		return RAPI_PARAM_ERROR;
+
+	align_job* job = malloc(sizeof(align_job));
+	if (NULL == job)
+		return RAPI_MEMORY_ERROR;
+	job->ref = ref;
+	job->batch = batch;
+	job->config = config;
+	job->callback = callback;
+	job->user_data = user_data;
+	job->next = NULL;
+
+	pthread_mutex_lock(&state->queue_lock);
+	if (!state->dispatcher_running) { // started on first use
+		if (pthread_create(&state->dispatcher, NULL, _align_dispatcher, state) != 0) {
+			pthread_mutex_unlock(&state->queue_lock);
+			free(job);
+			fprintf(stderr, "Failed to start alignment dispatcher thread\n");
+			return RAPI_GENERIC_ERROR;
+		}
+		state->dispatcher_running = 1;
+	}
+
+	if (state->queue_tail)
+		state->queue_tail->next = job;
+	else
+		state->queue_head = job;
+	state->queue_tail = job;
+	state->n_jobs += 1;
+	pthread_cond_signal(&state->queue_cond);
+	pthread_mutex_unlock(&state->queue_lock);
+
+	return RAPI_NO_ERROR;
+}
+
+int rapi_aligner_state_get_cache_stats(rapi_aligner_state* state, rapi_aln_cache_stats* stats)
+{
+	pthread_mutex_lock(&state->align_lock);
+	stats->hits = state->cache.hits;
+	stats->misses = state->cache.misses;
+	stats->n_entries = state->cache.n_entries;
+	stats->bytes = state->cache.bytes;
+	stats->capacity = state->cache.capacity;
+	pthread_mutex_unlock(&state->align_lock);
+	return RAPI_NO_ERROR;
+}
+
+int rapi_aligner_state_set_insert_size(rapi_aligner_state* state, double mean, double stddev, int freeze)
+{
+	if (mean <= 0 || stddev < 0)
+		return RAPI_PARAM_ERROR;
+	pthread_mutex_lock(&state->align_lock);
+	rapi_bwa_pestat_seed(&state->pestat, mean, stddev, freeze);
+	pthread_mutex_unlock(&state->align_lock);
+	return RAPI_NO_ERROR;
+}
+
+int rapi_aligner_state_get_insert_size(rapi_aligner_state* state, rapi_insert_size* isize)
+{
+	pthread_mutex_lock(&state->align_lock);
+	const mem_pestat_t* fr = &state->pestat.pes[1];
+	isize->valid = state->pestat.has_estimate && !fr->failed;
+	isize->mean = fr->avg;
+	isize->stddev = fr->std;
+	isize->low = fr->low;
+	isize->high = fr->high;
+	isize->frozen = state->pestat.frozen;
+	pthread_mutex_unlock(&state->align_lock);
+	return RAPI_NO_ERROR;
+}
+
+int rapi_aligner_state_wait(rapi_aligner_state* state)
+{
+	pthread_mutex_lock(&state->queue_lock);
+	if (_in_dispatcher(state)) {
+		// called by a callback, which holds up the dispatcher:  align the
+		// batches queued after its own here.
+		align_job* job;
+		while ((job = _pop_job(state))) {
+			pthread_mutex_unlock(&state->queue_lock);
+			_run_job(state, job);
+			pthread_mutex_lock(&state->queue_lock);
+		}
+	}
+	else {
+		while (state->n_jobs > 0)
+			pthread_cond_wait(&state->idle_cond, &state->queue_lock);
+	}
+	pthread_mutex_unlock(&state->queue_lock);
+	return RAPI_NO_ERROR;
+}
+
 /******* Generic functions ***********
  * These are generally usable. We should put them in a generic rapi.c file.
  *************************************/
@@ -1018,8 +2445,15 @@ int rapi_reads_alloc( rapi_batch * batch, int n_reads_fragment, int n_fragments
 	batch->reads = calloc( n_reads_fragment * n_fragments, sizeof(rapi_read) );
 	if (NULL == batch->reads)
 		return RAPI_MEMORY_ERROR;
+	batch->_arena = _arena_new();
+	if (NULL == batch->_arena) {
+		free(batch->reads);
+		batch->reads = NULL;
+		return RAPI_MEMORY_ERROR;
+	}
 	batch->n_frags = n_fragments;
 	batch->n_reads_frag = n_reads_fragment;
+	batch->packed = 0;
 	return RAPI_NO_ERROR;
 }
 
@@ -1047,28 +2481,253 @@ int rapi_reads_reserve(rapi_batch * batch, int n_fragments)
 	return RAPI_NO_ERROR;
 }
 
+int rapi_reads_clear( rapi_batch * batch )
+{
+	if (batch->_arena)
+		_arena_reset(batch->_arena);
+	if (batch->reads)
+		memset(batch->reads, 0, batch->n_frags * batch->n_reads_frag * sizeof(batch->reads[0]));
+	return RAPI_NO_ERROR;
+}
+
 int rapi_reads_free( rapi_batch * batch )
 {
-	for (int f = 0; f < batch->n_frags; ++f) {
-		for (int r = 0; r < batch->n_reads_frag; ++r) {
-			rapi_read* read = rapi_get_read(batch, f, r);
-			// the reads use a single chunk of memory for id, seq and quality
-			free(read->id);
-			for (int a = 0; a < read->n_alignments; ++a) {
-				for (int t = 0; t < read->alignments[a].tags.n; ++t)
-					rapi_tag_clear(&read->alignments[a].tags.a[t]);
-				kv_destroy(read->alignments[a].tags);
-				free(read->alignments[a].cigar_ops);
-			}
-			free(read->alignments);
-			read->n_alignments = 0;
-			// *Don't* free the contig name.  It belongs to the contig structure.
+	// All the read data lives in the arena, so there's nothing to free
+	// read by read.
+	_arena_free(batch->_arena);
+	free(batch->reads);
+	memset(batch, 0, sizeof(*batch));
+
+	return RAPI_NO_ERROR;
+}
+
+/*
+ * Read ingestion kernels.
+ *
+ * In a single pass over a read, these normalize the sequence to upper case
+ * and check that it only contains [ACGTN], and recode the base qualities
+ * from q_offset to Sanger (which BWA expects) while checking their range:
+ * Sanger qualities go from 0 to 93, i.e., from '!' (33) to '~' (126).
+ *
+ * seq_out may be NULL to only validate the sequence, and qual may be NULL
+ * if the read has no qualities;  qual_out may be NULL to only validate them.
+ * The output strings are not NULL-terminated.
+ *
+ * Return the position of the first invalid base or quality, or -1 if the
+ * read is good.
+ *
+ * A vectorized version is selected at run time based on the CPU, falling
+ * back to the scalar one.
+ */
+typedef int (*read_kernel_fn)(char* seq_out, char* qual_out, const char* seq, const char* qual, int len, int q_offset);
+
+#define SANGER_MAX_QUAL 93
+
+static const char _base_norm_table[256] = {
+	['A'] = 'A', ['C'] = 'C', ['G'] = 'G', ['T'] = 'T', ['N'] = 'N',
+	['a'] = 'A', ['c'] = 'C', ['g'] = 'G', ['t'] = 'T', ['n'] = 'N'
+}; // all other entries are 0, i.e., invalid
+
+static int _read_kernel_scalar(char* seq_out, char* qual_out, const char* seq, const char* qual, int len, int q_offset)
+{
+	for (int i = 0; i < len; ++i) {
+		const char b = _base_norm_table[(unsigned char)seq[i]];
+		if (!b)
+			return i;
+		if (seq_out)
+			seq_out[i] = b;
+		if (qual) {
+			const unsigned char q = (unsigned char)qual[i] - q_offset;
+			if (q > SANGER_MAX_QUAL)
+				return i;
+			if (qual_out)
+				qual_out[i] = q + 33;
 		}
 	}
+	return -1;
+}
 
-	free(batch->reads);
-	memset(batch, 0, sizeof(*batch));
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_READ_KERNEL_SIMD 1
+
+/*
+ * Converting to upper case by clearing bit 5 maps exactly {A,a} to 'A',
+ * {C,c} to 'C' and so on, so that the validity test can be done after the
+ * conversion.
+ */
+__attribute__((target("sse4.2")))
+static int _read_kernel_sse42(char* seq_out, char* qual_out, const char* seq, const char* qual, int len, int q_offset)
+{
+	const __m128i case_mask = _mm_set1_epi8((char)0xDF);
+	const __m128i bases = _mm_setr_epi8('A', 'C', 'G', 'T', 'N', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i offset = _mm_set1_epi8((char)q_offset);
+	const __m128i max_qual = _mm_set1_epi8(SANGER_MAX_QUAL);
+	const __m128i sanger = _mm_set1_epi8(33);
+
+	int i = 0;
+	for ( ; i + 16 <= len; i += 16) {
+		const __m128i u = _mm_and_si128(_mm_loadu_si128((const __m128i*)(seq + i)), case_mask);
+		// index of the first byte that isn't one of the 5 bases;  16 if none
+		int bad = _mm_cmpestri(bases, 5, u, 16,
+				_SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_NEGATIVE_POLARITY | _SIDD_LEAST_SIGNIFICANT);
+		if (qual) {
+			const __m128i q = _mm_sub_epi8(_mm_loadu_si128((const __m128i*)(qual + i)), offset);
+			const unsigned ok = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(q, max_qual), q));
+			if (ok != 0xFFFF && __builtin_ctz(~ok) < bad)
+				bad = __builtin_ctz(~ok);
+			if (qual_out)
+				_mm_storeu_si128((__m128i*)(qual_out + i), _mm_add_epi8(q, sanger));
+		}
+		if (bad < 16)
+			return i + bad;
+		if (seq_out)
+			_mm_storeu_si128((__m128i*)(seq_out + i), u);
+	}
+
+	const int bad = _read_kernel_scalar(seq_out ? seq_out + i : NULL, qual_out ? qual_out + i : NULL,
+			seq + i, qual ? qual + i : NULL, len - i, q_offset);
+	return bad < 0 ? -1 : i + bad;
+}
+
+__attribute__((target("avx2")))
+static int _read_kernel_avx2(char* seq_out, char* qual_out, const char* seq, const char* qual, int len, int q_offset)
+{
+	const __m256i case_mask = _mm256_set1_epi8((char)0xDF);
+	const __m256i base_a = _mm256_set1_epi8('A');
+	const __m256i base_c = _mm256_set1_epi8('C');
+	const __m256i base_g = _mm256_set1_epi8('G');
+	const __m256i base_t = _mm256_set1_epi8('T');
+	const __m256i base_n = _mm256_set1_epi8('N');
+	const __m256i offset = _mm256_set1_epi8((char)q_offset);
+	const __m256i max_qual = _mm256_set1_epi8(SANGER_MAX_QUAL);
+	const __m256i sanger = _mm256_set1_epi8(33);
+
+	int i = 0;
+	for ( ; i + 32 <= len; i += 32) {
+		const __m256i u = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(seq + i)), case_mask);
+		__m256i ok = _mm256_or_si256(
+				_mm256_or_si256(_mm256_cmpeq_epi8(u, base_a), _mm256_cmpeq_epi8(u, base_c)),
+				_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(u, base_g), _mm256_cmpeq_epi8(u, base_t)),
+				                _mm256_cmpeq_epi8(u, base_n)));
+		if (qual) {
+			const __m256i q = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i*)(qual + i)), offset);
+			ok = _mm256_and_si256(ok, _mm256_cmpeq_epi8(_mm256_min_epu8(q, max_qual), q));
+			if (qual_out)
+				_mm256_storeu_si256((__m256i*)(qual_out + i), _mm256_add_epi8(q, sanger));
+		}
+		const unsigned mask = (unsigned)_mm256_movemask_epi8(ok);
+		if (mask != 0xFFFFFFFFu)
+			return i + __builtin_ctz(~mask);
+		if (seq_out)
+			_mm256_storeu_si256((__m256i*)(seq_out + i), u);
+	}
+
+	const int bad = _read_kernel_scalar(seq_out ? seq_out + i : NULL, qual_out ? qual_out + i : NULL,
+			seq + i, qual ? qual + i : NULL, len - i, q_offset);
+	return bad < 0 ? -1 : i + bad;
+}
+#endif
+
+static read_kernel_fn _read_kernel = _read_kernel_scalar;
+static pthread_once_t _read_kernel_once = PTHREAD_ONCE_INIT;
+
+static void _select_read_kernel(void)
+{
+#ifdef HAVE_READ_KERNEL_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		_read_kernel = _read_kernel_avx2;
+	else if (__builtin_cpu_supports("sse4.2"))
+		_read_kernel = _read_kernel_sse42;
+#endif
+}
+
+static inline read_kernel_fn _get_read_kernel(void)
+{
+	pthread_once(&_read_kernel_once, _select_read_kernel);
+	return _read_kernel;
+}
+
+static void _report_bad_read(const char* name, int name_len, const char* seq, const char* qual, int pos, int q_offset)
+{
+	if (!_base_norm_table[(unsigned char)seq[pos]])
+		fprintf(stderr, "Invalid base '%c' at position %d of read %.*s\n", seq[pos], pos, name_len, name);
+	else
+		fprintf(stderr, "Invalid base quality score %d at position %d of read %.*s\n", (int)qual[pos] - q_offset, pos, name_len, name);
+}
+
+/* trim /[12]$ from the read name */
+static inline void _trim_read_id(char* id, int len)
+{
+	if (len > 2 && id[len-2] == '/' && (id[len-1] == '1' || id[len-1] == '2'))
+		id[len-2] = '\0';
+}
+
+int rapi_set_reads_bulk(rapi_batch* batch, int first_frag, int n_reads,
+			const char* ids, const size_t* id_offsets,
+			const char* seqs, const size_t* seq_offsets,
+			const char* quals, int q_offset) {
+	if (first_frag < 0 || n_reads < 0 || batch->n_reads_frag <= 0)
+		return RAPI_PARAM_ERROR;
+
+	const int n_reads_frag = batch->n_reads_frag;
+	int error = rapi_reads_reserve(batch, first_frag + (n_reads + n_reads_frag - 1) / n_reads_frag);
+	if (error)
+		return error;
+
+	const int first_read = first_frag * n_reads_frag;
+	for (int i = 0; i < n_reads; ++i) {
+		const int r = first_read + i;
+		error = rapi_set_read_n(batch, r / n_reads_frag, r % n_reads_frag,
+				ids + id_offsets[i], id_offsets[i+1] - id_offsets[i],
+				seqs + seq_offsets[i], seq_offsets[i+1] - seq_offsets[i],
+				quals ? quals + seq_offsets[i] : NULL, q_offset);
+		if (error)
+			return error;
+	}
+	return RAPI_NO_ERROR;
+}
+
+/* Space taken by a packed sequence:  the 2-bit codes and the N mask. */
+static inline int _packed_seq_size(int len)
+{
+	return (len + 3) / 4 + (len + 7) / 8;
+}
+
+/*
+ * Pack a validated sequence into `dst` (see rapi_read).  Lower case bases
+ * are accepted, since nst_nt4_table maps them like the upper case ones.
+ */
+static void _pack_seq(uint8_t* dst, const char* seq, int len)
+{
+	uint8_t* n_mask = dst + (len + 3) / 4;
+	memset(dst, 0, _packed_seq_size(len));
+
+	for (int i = 0; i < len; ++i) {
+		const uint8_t c = nst_nt4_table[(unsigned char)seq[i]];
+		if (c > 3)
+			n_mask[i >> 3] |= 1 << (i & 7);
+		else
+			dst[i >> 2] |= c << ((i & 3) << 1);
+	}
+}
+
+int rapi_read_get_seq(const rapi_read* read, char* buf)
+{
+	if (read->seq_packed) {
+		for (unsigned int i = 0; i < read->length; ++i)
+			buf[i] = rapi_read_base(read, i);
+	}
+	else
+		memcpy(buf, read->seq, read->length);
+	buf[read->length] = '\0';
+	return RAPI_NO_ERROR;
+}
 
+int rapi_reads_set_packed(rapi_batch* batch, int packed)
+{
+	batch->packed = packed != 0;
 	return RAPI_NO_ERROR;
 }
 
@@ -1076,62 +2735,123 @@ int rapi_set_read(rapi_batch* batch,
 			int n_frag, int n_read,
 			const char* name, const char* seq, const char* qual,
 			int q_offset) {
+	return rapi_set_read_n(batch, n_frag, n_read, name, strlen(name), seq, strlen(seq), qual, q_offset);
+}
+
+int rapi_set_read_n(rapi_batch* batch,
+			int n_frag, int n_read,
+			const char* name, int name_len,
+			const char* seq, int seq_len,
+			const char* qual, int q_offset) {
 	int error_code = RAPI_NO_ERROR;
 
 	if (n_frag < 0 || n_frag >= batch->n_frags
-	 || n_read < 0 || n_read >= batch->n_reads_frag)
+	 || n_read < 0 || n_read >= batch->n_reads_frag
+	 || name_len < 0 || seq_len < 0)
 		return RAPI_PARAM_ERROR;
 
+	rapi_arena* arena = _batch_arena(batch);
+	if (NULL == arena)
+		return RAPI_MEMORY_ERROR;
+
 	rapi_read* read = rapi_get_read(batch, n_frag, n_read);
-	const int name_len = strlen(name);
-	const int seq_len = strlen(seq);
 	read->length = seq_len;
 
 	// simplify allocation and error checking by allocating a single buffer
-	int buf_size = name_len + 1 + seq_len + 1;
+	const int seq_size = batch->packed ? _packed_seq_size(seq_len) : seq_len + 1;
+	int buf_size = name_len + 1 + seq_size;
 	if (qual)
 		buf_size += seq_len + 1;
 
-	read->id = malloc(buf_size);
+	read->id = _arena_alloc(arena, 0, buf_size);
 	if (NULL == read->id) { // failed allocation
 		fprintf(stderr, "Unable to allocate memory for sequence\n");
 		return RAPI_MEMORY_ERROR;
 	}
 
 	// copy name
-	strcpy(read->id, name);
+	memcpy(read->id, name, name_len);
+	read->id[name_len] = '\0';
 
-	// sequence, placed right after the name
+	// sequence, placed right after the name, followed by the quality
 	read->seq = read->id + name_len + 1;
-	strcpy(read->seq, seq);
-
-	// the quality, if we have it, may need to be recoded
+	read->seq_packed = batch->packed;
+	if (!batch->packed)
+		read->seq[seq_len] = '\0';
 	if (NULL == qual)
 		read->qual = NULL;
 	else {
-		read->qual = read->seq + seq_len + 1;
-		for (int i = 0; i < seq_len; ++i) {
-			read->qual[i] = (int)qual[i] - q_offset + 33; // 33 is the Sanger offset.  BWA expects it this way.
-			if (read->qual[i] > 127)
-			{ // qual is unsigned, by Sanger base qualities have an allowed range of [0,94], and 94+33=127
-				fprintf(stderr, "Invalid base quality score %d\n", read->qual[i]);
-				error_code = RAPI_PARAM_ERROR;
-				goto error;
-			}
-		}
+		read->qual = read->seq + seq_size;
 		read->qual[seq_len] = '\0';
 	}
 
-	// trim from the name /[12]$
-	int t = name_len;
-	if (t > 2 && read->id[t-2] == '/' && (read->id[t-1] == '1' || read->id[t-1] == '2'))
-		read->id[t-2] = '\0';
+	// copy the sequence and the quality, validating and normalizing them.
+	// Packed sequences are only validated here, and packed afterwards.
+	const int bad_pos = _get_read_kernel()(batch->packed ? NULL : read->seq, read->qual, seq, qual, seq_len, q_offset);
+	if (bad_pos >= 0) {
+		_report_bad_read(name, name_len, seq, qual, bad_pos, q_offset);
+		error_code = RAPI_PARAM_ERROR;
+		goto error;
+	}
+	if (batch->packed)
+		_pack_seq((uint8_t*)read->seq, seq, seq_len);
+
+	_trim_read_id(read->id, name_len);
 
 	return RAPI_NO_ERROR;
 
 error:
-	// In case of error, free any allocated memory and return the error
-	free(read->id);
+	// In case of error, drop the read's data.  Its space in the arena is
+	// reclaimed with the rest of the batch.
+	read->id = read->seq = read->qual = NULL;
+	read->length = 0;
+	read->seq_packed = 0;
 	return error_code;
 }
 
+int rapi_set_read_ref(rapi_batch* batch,
+			int n_frag, int n_read,
+			const char* name, int name_len,
+			const char* seq, int seq_len,
+			const char* qual, int q_offset) {
+	if (n_frag < 0 || n_frag >= batch->n_frags
+	 || n_read < 0 || n_read >= batch->n_reads_frag
+	 || name_len < 0 || seq_len < 0)
+		return RAPI_PARAM_ERROR;
+
+	rapi_arena* arena = _batch_arena(batch);
+	if (NULL == arena)
+		return RAPI_MEMORY_ERROR;
+
+	// The name is short and it has to be NULL-terminated and trimmed, so we copy it
+	char* id = _arena_strndup(arena, 0, name, name_len);
+	if (NULL == id)
+		return RAPI_MEMORY_ERROR;
+	_trim_read_id(id, name_len);
+
+	// Qualities are only copied if they need to be recoded
+	char* read_qual = (char*)qual;
+	if (qual && q_offset != RAPI_QUALITY_ENCODING_SANGER) {
+		read_qual = _arena_alloc(arena, 0, seq_len + 1);
+		if (NULL == read_qual)
+			return RAPI_MEMORY_ERROR;
+		read_qual[seq_len] = '\0';
+	}
+
+	// The sequence is validated but, since we can't write to it, not
+	// normalized to upper case.
+	const int bad_pos = _get_read_kernel()(NULL, read_qual != qual ? read_qual : NULL, seq, qual, seq_len, q_offset);
+	if (bad_pos >= 0) {
+		_report_bad_read(name, name_len, seq, qual, bad_pos, q_offset);
+		return RAPI_PARAM_ERROR;
+	}
+
+	rapi_read* read = rapi_get_read(batch, n_frag, n_read);
+	read->id = id;
+	read->seq = (char*)seq; // never modified:  BWA works on a copy
+	read->seq_packed = 0;
+	read->qual = read_qual;
+	read->length = seq_len;
+	return RAPI_NO_ERROR;
+}
+
@@ -0,0 +1,418 @@
+/*
+ * rapi_fastq.c
+ *
+ * Streaming FASTQ reader that fills rapi_batch structures.
+ *
+ * A background thread decompresses and parses the input into chunks of
+ * records.  Each record is kept as offsets into the chunk's text buffer, so
+ * rapi_batch_fill_fastq can hand id, sequence and quality to
+ * rapi_set_read_n without any further scanning of the strings.
+ */
+
+#include <rapi.h>
+#include <kstring.h>
+#include <kvec.h>
+
+#include <zlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define STREAM_BUF_SIZE    (1 << 16)
+#define CHUNK_MAX_FRAGS    (1 << 13)
+#define CHUNK_MAX_BYTES    (1 << 22)
+#define N_CHUNKS           3   // one being consumed, two being filled or waiting
+
+/******** Input stream *******/
+typedef struct {
+	gzFile fp;
+	unsigned char* buf;
+	int begin, end;
+	int is_eof;
+} fastq_stream;
+
+static int _stream_open(fastq_stream* in, const char* path)
+{
+	memset(in, 0, sizeof(*in));
+	in->fp = gzopen(path, "r");
+	if (NULL == in->fp) {
+		fprintf(stderr, "Unable to open FASTQ file %s\n", path);
+		return RAPI_GENERIC_ERROR;
+	}
+	gzbuffer(in->fp, STREAM_BUF_SIZE);
+	in->buf = malloc(STREAM_BUF_SIZE);
+	if (NULL == in->buf) {
+		gzclose(in->fp);
+		in->fp = NULL;
+		return RAPI_MEMORY_ERROR;
+	}
+	return RAPI_NO_ERROR;
+}
+
+static void _stream_close(fastq_stream* in)
+{
+	if (in->fp)
+		gzclose(in->fp);
+	free(in->buf);
+	memset(in, 0, sizeof(*in));
+}
+
+/*
+ * Append the next line, without its line terminator, to `out`.
+ *
+ * Returns the length of the line, -1 at the end of the input or a RAPI
+ * error code (< -1) in case of problems.
+ */
+static int _stream_getline(fastq_stream* in, kstring_t* out)
+{
+	const size_t start = out->l;
+	int found_newline = 0;
+	int got_data = 0;
+
+	while (!found_newline) {
+		if (in->begin >= in->end) {
+			if (in->is_eof)
+				break;
+			in->begin = 0;
+			in->end = gzread(in->fp, in->buf, STREAM_BUF_SIZE);
+			if (in->end < 0) {
+				int errnum;
+				fprintf(stderr, "Error reading FASTQ input: %s\n", gzerror(in->fp, &errnum));
+				in->end = 0;
+				return RAPI_GENERIC_ERROR;
+			}
+			if (in->end == 0) {
+				in->is_eof = 1;
+				break;
+			}
+		}
+
+		const unsigned char* nl = memchr(in->buf + in->begin, '\n', in->end - in->begin);
+		const int stop = nl ? (int)(nl - in->buf) : in->end;
+		if (kputsn((const char*)in->buf + in->begin, stop - in->begin, out) == EOF)
+			return RAPI_MEMORY_ERROR;
+		got_data = 1;
+		in->begin = stop;
+		if (nl) {
+			in->begin += 1; // skip the newline
+			found_newline = 1;
+		}
+	}
+
+	if (!got_data)
+		return -1;
+
+	if (out->l > start && out->s[out->l - 1] == '\r') // DOS line endings
+		out->s[--out->l] = '\0';
+	return (int)(out->l - start);
+}
+
+/******** Parsed chunks *******/
+typedef struct {
+	size_t id, seq, qual; // offsets into the chunk's text buffer
+	int id_len, seq_len;
+} fastq_record;
+
+typedef struct {
+	kstring_t text;
+	kvec_t(fastq_record) records;
+	int n_frags;
+	int next_frag;   // next fragment to be consumed
+} fastq_chunk;
+
+/*
+ * Parse the next record from `in`, appending its text to the chunk.
+ *
+ * Returns 1 if a record was read, 0 at the end of the input or a RAPI error code.
+ */
+static int _read_record(fastq_stream* in, fastq_chunk* chunk, fastq_record* rec)
+{
+	kstring_t* text = &chunk->text;
+	int len;
+
+	// header line, skipping any blank lines before it
+	do {
+		rec->id = text->l;
+		len = _stream_getline(in, text);
+	} while (len == 0);
+
+	if (len == -1)
+		return 0;
+	if (len < 0)
+		return len;
+	if (text->s[rec->id] != '@') {
+		fprintf(stderr, "Bad FASTQ record: header line doesn't start with '@'\n");
+		return RAPI_PARAM_ERROR;
+	}
+	rec->id += 1;
+	rec->id_len = 0;
+	while (rec->id + rec->id_len < text->l
+	    && text->s[rec->id + rec->id_len] != ' ' && text->s[rec->id + rec->id_len] != '\t')
+		rec->id_len += 1;
+
+	// sequence
+	rec->seq = text->l;
+	len = _stream_getline(in, text);
+	if (len < 0)
+		goto truncated;
+	rec->seq_len = len;
+
+	// separator.  Dropped from the buffer once checked.
+	size_t sep = text->l;
+	len = _stream_getline(in, text);
+	if (len < 0)
+		goto truncated;
+	if (text->s[sep] != '+') {
+		fprintf(stderr, "Bad FASTQ record: separator line doesn't start with '+'\n");
+		return RAPI_PARAM_ERROR;
+	}
+	text->l = sep;
+
+	// quality
+	rec->qual = text->l;
+	len = _stream_getline(in, text);
+	if (len < 0)
+		goto truncated;
+	if (len != rec->seq_len) {
+		fprintf(stderr, "Bad FASTQ record: sequence and quality have different lengths (%d, %d)\n", rec->seq_len, len);
+		return RAPI_PARAM_ERROR;
+	}
+	return 1;
+
+truncated:
+	if (len < -1) // error reading
+		return len;
+	fprintf(stderr, "Bad FASTQ record: truncated input\n");
+	return RAPI_PARAM_ERROR;
+}
+
+/*
+ * Whether two mates have the same name, ignoring /1 and /2 suffixes (as
+ * BWA does).
+ */
+static int _same_mate_name(const char* text, const fastq_record* r1, const fastq_record* r2)
+{
+	const char* n1 = text + r1->id;
+	const char* n2 = text + r2->id;
+	int l1 = r1->id_len, l2 = r2->id_len;
+	if (l1 > 2 && n1[l1 - 2] == '/' && (n1[l1 - 1] == '1' || n1[l1 - 1] == '2'))
+		l1 -= 2;
+	if (l2 > 2 && n2[l2 - 2] == '/' && (n2[l2 - 1] == '1' || n2[l2 - 1] == '2'))
+		l2 -= 2;
+	return l1 == l2 && memcmp(n1, n2, l1) == 0;
+}
+
+/******** Reader *******/
+struct rapi_fastq_reader {
+	fastq_stream in[2];
+	int n_streams;
+	int n_reads_frag;
+	int q_offset;
+
+	fastq_chunk chunks[N_CHUNKS];
+	// ring of chunks: `head` is the next one to be consumed.  Chunks are
+	// filled in ring order.
+	int head;
+	int n_ready;
+	int eof;        // set by the parser after the last chunk
+	int error;      // set by the parser if it fails
+	int shutdown;
+
+	pthread_t parser;
+	pthread_mutex_t lock;
+	pthread_cond_t ready_cond;  // signalled when a chunk is ready
+	pthread_cond_t free_cond;   // signalled when a chunk is released
+};
+
+/*
+ * Fill `chunk` with up to CHUNK_MAX_FRAGS fragments.  Returns the number of
+ * fragments read or a RAPI error code.
+ */
+static int _fill_chunk(rapi_fastq_reader* reader, fastq_chunk* chunk)
+{
+	chunk->text.l = 0;
+	chunk->records.n = 0;
+	chunk->n_frags = 0;
+	chunk->next_frag = 0;
+
+	while (chunk->n_frags < CHUNK_MAX_FRAGS && chunk->text.l < CHUNK_MAX_BYTES) {
+		for (int r = 0; r < reader->n_reads_frag; ++r) {
+			fastq_stream* in = &reader->in[reader->n_streams == 2 ? r : 0];
+			fastq_record rec;
+			int ret = _read_record(in, chunk, &rec);
+			if (ret < 0)
+				return ret;
+			if (ret == 0) {
+				if (r == 0)
+					return chunk->n_frags;
+				fprintf(stderr, "FASTQ input ended in the middle of a read pair\n");
+				return RAPI_PARAM_ERROR;
+			}
+			kv_push(fastq_record, chunk->records, rec);
+		}
+		if (reader->n_reads_frag == 2) { // the mates must be listed in the same order
+			const fastq_record* r1 = &kv_A(chunk->records, chunk->records.n - 2);
+			const fastq_record* r2 = &kv_A(chunk->records, chunk->records.n - 1);
+			if (!_same_mate_name(chunk->text.s, r1, r2)) {
+				fprintf(stderr, "Bad FASTQ input: mates have different names (%.*s, %.*s)\n",
+						r1->id_len, chunk->text.s + r1->id, r2->id_len, chunk->text.s + r2->id);
+				return RAPI_PARAM_ERROR;
+			}
+		}
+		chunk->n_frags += 1;
+	}
+	return chunk->n_frags;
+}
+
+static void* _parser_thread(void* arg)
+{
+	rapi_fastq_reader* reader = (rapi_fastq_reader*)arg;
+	int slot = 0;
+
+	while (1) {
+		pthread_mutex_lock(&reader->lock);
+		while (!reader->shutdown && reader->n_ready == N_CHUNKS - 1)
+			pthread_cond_wait(&reader->free_cond, &reader->lock);
+		if (reader->shutdown) {
+			pthread_mutex_unlock(&reader->lock);
+			break;
+		}
+		pthread_mutex_unlock(&reader->lock);
+
+		int n = _fill_chunk(reader, &reader->chunks[slot]);
+
+		pthread_mutex_lock(&reader->lock);
+		if (n < 0)
+			reader->error = n;
+		else if (n == 0)
+			reader->eof = 1;
+		else {
+			reader->n_ready += 1;
+			slot = (slot + 1) % N_CHUNKS;
+		}
+		pthread_cond_signal(&reader->ready_cond);
+		pthread_mutex_unlock(&reader->lock);
+
+		if (n <= 0)
+			break;
+	}
+	return NULL;
+}
+
+int rapi_fastq_open(const char* path1, const char* path2, int interleaved, int q_offset, rapi_fastq_reader** ret_reader)
+{
+	if (NULL == path1 || NULL == ret_reader || (path2 && interleaved))
+		return RAPI_PARAM_ERROR;
+
+	rapi_fastq_reader* reader = calloc(1, sizeof(*reader));
+	if (NULL == reader)
+		return RAPI_MEMORY_ERROR;
+
+	reader->n_streams = path2 ? 2 : 1;
+	reader->n_reads_frag = (path2 || interleaved) ? 2 : 1;
+	reader->q_offset = q_offset;
+
+	int error = _stream_open(&reader->in[0], path1);
+	if (!error && path2)
+		error = _stream_open(&reader->in[1], path2);
+	if (error) {
+		_stream_close(&reader->in[0]);
+		free(reader);
+		return error;
+	}
+
+	pthread_mutex_init(&reader->lock, NULL);
+	pthread_cond_init(&reader->ready_cond, NULL);
+	pthread_cond_init(&reader->free_cond, NULL);
+	if (pthread_create(&reader->parser, NULL, _parser_thread, reader) != 0) {
+		fprintf(stderr, "Failed to start FASTQ parser thread\n");
+		pthread_cond_destroy(&reader->free_cond);
+		pthread_cond_destroy(&reader->ready_cond);
+		pthread_mutex_destroy(&reader->lock);
+		for (int i = 0; i < reader->n_streams; ++i)
+			_stream_close(&reader->in[i]);
+		free(reader);
+		return RAPI_GENERIC_ERROR;
+	}
+
+	*ret_reader = reader;
+	return RAPI_NO_ERROR;
+}
+
+int rapi_fastq_reads_per_frag(const rapi_fastq_reader* reader)
+{
+	return reader->n_reads_frag;
+}
+
+int rapi_fastq_close(rapi_fastq_reader* reader)
+{
+	pthread_mutex_lock(&reader->lock);
+	reader->shutdown = 1;
+	pthread_cond_signal(&reader->free_cond);
+	pthread_mutex_unlock(&reader->lock);
+	pthread_join(reader->parser, NULL);
+
+	pthread_cond_destroy(&reader->free_cond);
+	pthread_cond_destroy(&reader->ready_cond);
+	pthread_mutex_destroy(&reader->lock);
+
+	for (int i = 0; i < reader->n_streams; ++i)
+		_stream_close(&reader->in[i]);
+	for (int c = 0; c < N_CHUNKS; ++c) {
+		free(reader->chunks[c].text.s);
+		kv_destroy(reader->chunks[c].records);
+	}
+	free(reader);
+	return RAPI_NO_ERROR;
+}
+
+int rapi_batch_fill_fastq(rapi_fastq_reader* reader, rapi_batch* batch, int max_frags, int* n_filled)
+{
+	if (max_frags < 0 || batch->n_reads_frag != reader->n_reads_frag || NULL == n_filled)
+		return RAPI_PARAM_ERROR;
+
+	int n_frags = 0;
+	int error = rapi_reads_reserve(batch, max_frags);
+	if (error)
+		goto out;
+
+	while (n_frags < max_frags) {
+		pthread_mutex_lock(&reader->lock);
+		while (reader->n_ready == 0 && !reader->eof && !reader->error)
+			pthread_cond_wait(&reader->ready_cond, &reader->lock);
+		const int have_chunk = reader->n_ready > 0;
+		error = have_chunk ? RAPI_NO_ERROR : reader->error;
+		pthread_mutex_unlock(&reader->lock);
+
+		if (!have_chunk) // end of input or error
+			break;
+
+		fastq_chunk* chunk = &reader->chunks[reader->head];
+		for ( ; chunk->next_frag < chunk->n_frags && n_frags < max_frags; ++chunk->next_frag, ++n_frags) {
+			for (int r = 0; r < reader->n_reads_frag; ++r) {
+				const fastq_record* rec = &kv_A(chunk->records, chunk->next_frag * reader->n_reads_frag + r);
+				const char* text = chunk->text.s;
+				error = rapi_set_read_n(batch, n_frags, r,
+						text + rec->id, rec->id_len,
+						text + rec->seq, rec->seq_len,
+						text + rec->qual, reader->q_offset);
+				if (error) // the fragment is incomplete
+					goto out;
+			}
+		}
+
+		if (chunk->next_frag == chunk->n_frags) { // give the chunk back to the parser
+			pthread_mutex_lock(&reader->lock);
+			reader->head = (reader->head + 1) % N_CHUNKS;
+			reader->n_ready -= 1;
+			pthread_cond_signal(&reader->free_cond);
+			pthread_mutex_unlock(&reader->lock);
+		}
+	}
+
+out:
+	// only the complete fragments, also in case of errors
+	*n_filled = n_frags;
+	return error;
+}
@@ -0,0 +1,1686 @@
+/*
+ * rapi_index.c
+ *
+ * Loading of the BWA reference index.
+ *
+ * Besides letting BWA read the index into the heap, the index files can be
+ * memory-mapped read-only.  The BWT, SA and packed reference are then
+ * used directly from the page cache, so every aligner process on a node
+ * shares a single copy of them and loading only costs a few system calls.
+ *
+ * Finally, the whole index can be saved to, and mapped from, a single
+ * snapshot file laid out so that it can be used as it is.
+ *
+ * Indices read into memory can be placed on huge pages, and any of them can
+ * be replicated on the NUMA nodes of the machine.
+ *
+ * This file also builds new indices (rapi_ref_build).
+ */
+
+#define _GNU_SOURCE // for MAP_POPULATE, MAP_HUGETLB, MADV_HUGEPAGE and sched_getcpu
+
+#include "rapi_index.h"
+
+#include <bwt.h>
+#include <bntseq.h>
+#include <kstring.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#ifdef HAVE_LIBNUMA
+#include <numa.h>
+#include <numaif.h>
+#include <sched.h>
+#endif
+
+/*
+ * Layout of the BWA index files (see bwt_dump_bwt and bwt_dump_sa).  All
+ * the fields are bwtint_t.
+ *
+ * .bwt:  primary, L2[1..4], followed by the BWT array (with the interleaved
+ *        occurrence counts) as uint32_t.
+ * .sa:   primary, L2[1..4], sa_intv, seq_len, followed by sa[1..n_sa-1].
+ *        sa[0] isn't stored:  it's always -1.
+ * .pac:  the 2-bit reference, in l_pac / 4 + 1 bytes, plus a trailer.
+ */
+#define BWT_HEADER_SIZE  (5 * sizeof(bwtint_t))
+#define SA_HEADER_SIZE   (7 * sizeof(bwtint_t))
+
+#ifndef MAP_HUGE_SHIFT // not defined by older C libraries
+#define MAP_HUGE_SHIFT 26
+#endif
+#define HUGE_PAGE_2M ((size_t)1 << 21)
+#define HUGE_PAGE_1G ((size_t)1 << 30)
+
+/*
+ * Map `len` bytes of `filename` (the whole file if len is 0).  The
+ * mapping is private, so that the few header bytes we patch are copied
+ * on write without touching the shared pages.
+ */
+static int _map_file(const char* filename, size_t len, int flags, index_mapping* map)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to open %s: %s\n", filename, strerror(errno));
+		return RAPI_GENERIC_ERROR;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		fprintf(stderr, "Unable to stat %s: %s\n", filename, strerror(errno));
+		close(fd);
+		return RAPI_GENERIC_ERROR;
+	}
+	if (len == 0)
+		len = st.st_size;
+	else if ((size_t)st.st_size < len) {
+		fprintf(stderr, "Index file %s is truncated (%lld bytes; expected at least %zu)\n",
+				filename, (long long)st.st_size, len);
+		close(fd);
+		return RAPI_GENERIC_ERROR;
+	}
+
+	int mmap_flags = MAP_PRIVATE;
+	if (flags & RAPI_REF_MMAP_POPULATE)
+		mmap_flags |= MAP_POPULATE;
+
+	void* addr = MAP_FAILED;
+	if (flags & RAPI_REF_MMAP_HUGETLB) {
+		// Only works for files on hugetlbfs.  Otherwise, fall back to
+		// normal pages and let the kernel use transparent huge pages if it can.
+		addr = mmap(NULL, len, PROT_READ | PROT_WRITE, mmap_flags | MAP_HUGETLB, fd, 0);
+	}
+	if (addr == MAP_FAILED) {
+		addr = mmap(NULL, len, PROT_READ | PROT_WRITE, mmap_flags, fd, 0);
+#ifdef MADV_HUGEPAGE
+		if (addr != MAP_FAILED && (flags & RAPI_REF_MMAP_HUGETLB))
+			madvise(addr, len, MADV_HUGEPAGE);
+#endif
+	}
+	close(fd); // the mapping keeps its own reference to the file
+
+	if (addr == MAP_FAILED) {
+		fprintf(stderr, "Unable to map %s: %s\n", filename, strerror(errno));
+		return RAPI_MEMORY_ERROR;
+	}
+	map->addr = addr;
+	map->len = len;
+	return RAPI_NO_ERROR;
+}
+
+/*
+ * Allocate `len` bytes of zeroed memory on huge pages for an index array
+ * (RAPI_REF_LOAD_HUGEPAGES):  1 GB pages if requested, else 2 MB ones from
+ * the hugetlb pool.  If the pool doesn't have enough free pages, fall back
+ * to normal pages, advised for transparent huge pages.
+ */
+static int _alloc_huge(size_t len, int flags, index_mapping* map)
+{
+	const int mmap_flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	const int prot = PROT_READ | PROT_WRITE;
+	void* addr = MAP_FAILED;
+	size_t map_len = 0;
+
+	if (flags & RAPI_REF_HUGEPAGES_1G) {
+		map_len = (len + HUGE_PAGE_1G - 1) & ~(HUGE_PAGE_1G - 1);
+		addr = mmap(NULL, map_len, prot, mmap_flags | MAP_HUGETLB | (30 << MAP_HUGE_SHIFT), -1, 0);
+	}
+	if (addr == MAP_FAILED) {
+		map_len = (len + HUGE_PAGE_2M - 1) & ~(HUGE_PAGE_2M - 1);
+		addr = mmap(NULL, map_len, prot, mmap_flags | MAP_HUGETLB | (21 << MAP_HUGE_SHIFT), -1, 0);
+	}
+	if (addr == MAP_FAILED) {
+		map_len = len;
+		addr = mmap(NULL, map_len, prot, mmap_flags, -1, 0);
+#ifdef MADV_HUGEPAGE
+		if (addr != MAP_FAILED)
+			madvise(addr, map_len, MADV_HUGEPAGE);
+#endif
+	}
+	if (addr == MAP_FAILED) {
+		fprintf(stderr, "Unable to allocate %zu bytes for the index: %s\n", len, strerror(errno));
+		return RAPI_MEMORY_ERROR;
+	}
+	map->addr = addr;
+	map->len = map_len;
+	return RAPI_NO_ERROR;
+}
+
+/* Allocate an index array, in map if it goes on huge pages */
+static void* _alloc_array(const bwa_ref* ref, size_t len, index_mapping* map)
+{
+	if (ref->flags & RAPI_REF_LOAD_HUGEPAGES)
+		return _alloc_huge(len, ref->flags, map) ? NULL : map->addr;
+	return calloc(len, 1);
+}
+
+static void _unmap(index_mapping* map)
+{
+	if (map->addr)
+		munmap(map->addr, map->len);
+	map->addr = NULL;
+	map->len = 0;
+}
+
+static void _free_array(const bwa_ref* ref, void* array, index_mapping* map)
+{
+	if (ref->flags & RAPI_REF_LOAD_HUGEPAGES)
+		_unmap(map);
+	else
+		free(array);
+}
+
+static int _map_bwt(const char* prefix, int flags, bwa_ref* ref, bwt_t** ret_bwt)
+{
+	const size_t fn_len = strlen(prefix) + 10;
+	char* fn = malloc(fn_len);
+	bwt_t* bwt = calloc(1, sizeof(*bwt));
+	if (NULL == fn || NULL == bwt) {
+		free(fn);
+		free(bwt);
+		return RAPI_MEMORY_ERROR;
+	}
+
+	// BWT
+	snprintf(fn, fn_len, "%s.bwt", prefix);
+	int error = _map_file(fn, 0, flags, &ref->bwt_map);
+	if (error)
+		goto error;
+	if (ref->bwt_map.len <= BWT_HEADER_SIZE) {
+		fprintf(stderr, "Index file %s is truncated\n", fn);
+		error = RAPI_GENERIC_ERROR;
+		goto error;
+	}
+
+	const bwtint_t* header = ref->bwt_map.addr;
+	bwt->primary = header[0];
+	memcpy(bwt->L2 + 1, header + 1, 4 * sizeof(bwtint_t));
+	bwt->seq_len = bwt->L2[4];
+	bwt->bwt_size = (ref->bwt_map.len - BWT_HEADER_SIZE) >> 2;
+	bwt->bwt = (uint32_t*)((char*)ref->bwt_map.addr + BWT_HEADER_SIZE);
+	bwt_gen_cnt_table(bwt);
+
+	// SA
+	snprintf(fn, fn_len, "%s.sa", prefix);
+	error = _map_file(fn, 0, flags, &ref->sa_map);
+	if (error)
+		goto error;
+	header = ref->sa_map.addr;
+	if (ref->sa_map.len < SA_HEADER_SIZE || header[0] != bwt->primary || header[6] != bwt->seq_len || header[5] == 0) {
+		fprintf(stderr, "SA-BWT inconsistency in %s\n", fn);
+		error = RAPI_GENERIC_ERROR;
+		goto error;
+	}
+	bwt->sa_intv = header[5];
+	bwt->n_sa = (bwt->seq_len + bwt->sa_intv) / bwt->sa_intv;
+	if (ref->sa_map.len < SA_HEADER_SIZE + (bwt->n_sa - 1) * sizeof(bwtint_t)) {
+		fprintf(stderr, "Index file %s is truncated\n", fn);
+		error = RAPI_GENERIC_ERROR;
+		goto error;
+	}
+	// sa[1] is the first value in the file, so sa[0] overlays the seq_len
+	// header field.  Writing it only copies the first page of the mapping.
+	bwt->sa = (bwtint_t*)((char*)ref->sa_map.addr + SA_HEADER_SIZE) - 1;
+	bwt->sa[0] = (bwtint_t)-1;
+
+	free(fn);
+	*ret_bwt = bwt;
+	return RAPI_NO_ERROR;
+
+error:
+	_unmap(&ref->bwt_map);
+	_unmap(&ref->sa_map);
+	free(fn);
+	free(bwt);
+	return error;
+}
+
+/*
+ * Read the contig annotations (the .ann and .amb files), which is all that
+ * ref->idx holds until the rest of the index is loaded or mapped.
+ */
+static int _load_metadata(const char* path, bwa_ref* ref)
+{
+	ref->prefix = bwa_idx_infer_prefix(path);
+	if (NULL == ref->prefix) {
+		fprintf(stderr, "Could not locate the index for %s\n", path);
+		return RAPI_GENERIC_ERROR;
+	}
+
+	ref->idx = calloc(1, sizeof(bwaidx_t));
+	if (NULL == ref->idx)
+		return RAPI_MEMORY_ERROR;
+
+	// The contig annotations are small and BWA keeps them as separate
+	// allocations, so we let it read them as usual.
+	ref->idx->bns = bns_restore(ref->prefix);
+	if (NULL == ref->idx->bns)
+		return RAPI_GENERIC_ERROR;
+	// the pac is opened again when it's needed
+	if (ref->idx->bns->fp_pac) {
+		fclose(ref->idx->bns->fp_pac);
+		ref->idx->bns->fp_pac = NULL;
+	}
+	return RAPI_NO_ERROR;
+}
+
+/*
+ * Map the BWT, SA and pac of an index whose metadata is loaded.  On error,
+ * whatever has been mapped is released by _destroy_ref.
+ */
+static int _map_data(bwa_ref* ref)
+{
+	int error = _map_bwt(ref->prefix, ref->flags, ref, &ref->idx->bwt);
+	if (error)
+		return error;
+
+	char* fn = malloc(strlen(ref->prefix) + 5);
+	if (NULL == fn)
+		return RAPI_MEMORY_ERROR;
+	sprintf(fn, "%s.pac", ref->prefix);
+	error = _map_file(fn, ref->idx->bns->l_pac / 4 + 1, ref->flags, &ref->pac_map);
+	free(fn);
+	if (error)
+		return error;
+	ref->idx->pac = ref->pac_map.addr;
+	return RAPI_NO_ERROR;
+}
+
+/******** bwa_ref life cycle *******/
+
+static void _destroy_ref(bwa_ref* ref);
+static void _replicate_index(bwa_ref* ref);
+static int _load_data(bwa_ref* ref);
+
+static bwa_ref* _new_ref(int flags)
+{
+	static uint64_t last_generation = 0;
+
+	bwa_ref* ref = calloc(1, sizeof(*ref));
+	if (NULL == ref)
+		return NULL;
+	ref->flags = flags;
+	ref->generation = __sync_add_and_fetch(&last_generation, 1);
+	pthread_mutex_init(&ref->load_lock, NULL);
+	pthread_cond_init(&ref->load_cond, NULL);
+	return ref;
+}
+
+/* Free the bwa_ref structure itself, not the index */
+static void _free_ref(bwa_ref* ref)
+{
+	pthread_mutex_destroy(&ref->load_lock);
+	pthread_cond_destroy(&ref->load_cond);
+	free(ref->prefix);
+	free(ref->id.path);
+	free(ref);
+}
+
+/* Mark an index loaded in one go as ready, with all its data loaded. */
+static void _set_loaded(bwa_ref* ref)
+{
+	ref->progress.bwt.total = ref->progress.bwt.loaded = ref->idx->bwt->bwt_size * sizeof(uint32_t);
+	ref->progress.sa.total = ref->progress.sa.loaded = ref->idx->bwt->n_sa * sizeof(bwtint_t);
+	ref->progress.pac.total = ref->progress.pac.loaded = ref->idx->bns->l_pac / 4 + 1;
+	ref->progress.ready = 1;
+}
+
+/******** Snapshots *******/
+
+/*
+ * A snapshot is a header followed by sections, each starting at a multiple
+ * of SNAPSHOT_ALIGN from the beginning of the file.  Sections only hold
+ * offsets, never pointers, so the file can be mapped anywhere.  The big
+ * arrays (BWT, SA, pac) and the ambiguity records are used in place;  only
+ * the small per-contig array, which must hold pointers to the names, is
+ * built at load time.
+ *
+ * The format uses the native byte order and structure layout, so snapshots
+ * are meant for machines of the same architecture.
+ */
+#define SNAPSHOT_MAGIC    "RAPIBWA"
+#define SNAPSHOT_VERSION  1
+#define SNAPSHOT_ALIGN    4096
+#define SNAPSHOT_BYTE_ORDER 0x0102030405060708ULL
+
+enum {
+	SNAP_CNT_TABLE, // bwt_t.cnt_table
+	SNAP_BWT,       // bwt_t.bwt
+	SNAP_SA,        // bwt_t.sa, including sa[0]
+	SNAP_PAC,       // packed reference
+	SNAP_ANNS,      // snapshot_ann[n_seqs]
+	SNAP_AMBS,      // bntamb1_t[n_holes]
+	SNAP_STRINGS,   // NULL-terminated contig names and annotations
+	N_SNAP_SECTIONS
+};
+
+typedef struct {
+	uint64_t offset;
+	uint64_t size;
+} snapshot_section;
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint64_t byte_order;
+	uint32_t amb_size; // sizeof(bntamb1_t) of the writer
+	uint32_t sa_intv;
+
+	// bwt_t
+	uint64_t primary;
+	uint64_t L2[5];
+	uint64_t seq_len;
+	uint64_t bwt_size;
+	uint64_t n_sa;
+
+	// bntseq_t
+	int64_t l_pac;
+	int32_t n_seqs;
+	uint32_t seed;
+	int32_t n_holes;
+	uint32_t _pad;
+
+	snapshot_section sections[N_SNAP_SECTIONS];
+} snapshot_header;
+
+typedef struct {
+	int64_t offset;
+	int32_t len;
+	int32_t n_ambs;
+	uint32_t gi;
+	uint32_t _pad;
+	uint64_t name;  // offsets into the string section
+	uint64_t anno;
+} snapshot_ann;
+
+static inline uint64_t _snapshot_align(uint64_t offset)
+{
+	return (offset + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+}
+
+static int _write_section(FILE* fp, const snapshot_section* section, const void* data)
+{
+	static const char zeros[SNAPSHOT_ALIGN];
+
+	const long pos = ftell(fp);
+	if (pos < 0 || (uint64_t)pos > section->offset)
+		return RAPI_GENERIC_ERROR;
+	if (fwrite(zeros, 1, section->offset - pos, fp) != section->offset - pos)
+		return RAPI_GENERIC_ERROR;
+	if (section->size > 0 && fwrite(data, 1, section->size, fp) != section->size)
+		return RAPI_GENERIC_ERROR;
+	return RAPI_NO_ERROR;
+}
+
+int rapi_bwa_ref_save_snapshot(const bwa_ref* ref, const char* path)
+{
+	const bwt_t* bwt = ref->idx->bwt;
+	const bntseq_t* bns = ref->idx->bns;
+
+	snapshot_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+	header.version = SNAPSHOT_VERSION;
+	header.header_size = sizeof(header);
+	header.byte_order = SNAPSHOT_BYTE_ORDER;
+	header.amb_size = sizeof(bntamb1_t);
+	header.sa_intv = bwt->sa_intv;
+	header.primary = bwt->primary;
+	memcpy(header.L2, bwt->L2, sizeof(header.L2));
+	header.seq_len = bwt->seq_len;
+	header.bwt_size = bwt->bwt_size;
+	header.n_sa = bwt->n_sa;
+	header.l_pac = bns->l_pac;
+	header.n_seqs = bns->n_seqs;
+	header.seed = bns->seed;
+	header.n_holes = bns->n_holes;
+
+	// Lay out the contig annotations and their strings
+	snapshot_ann* anns = calloc(bns->n_seqs > 0 ? bns->n_seqs : 1, sizeof(*anns));
+	kstring_t strings = { 0, 0, NULL };
+	if (NULL == anns)
+		return RAPI_MEMORY_ERROR;
+	for (int i = 0; i < bns->n_seqs; ++i) {
+		const bntann1_t* a = bns->anns + i;
+		anns[i].offset = a->offset;
+		anns[i].len = a->len;
+		anns[i].n_ambs = a->n_ambs;
+		anns[i].gi = a->gi;
+		anns[i].name = strings.l;
+		kputsn(a->name ? a->name : "", a->name ? strlen(a->name) + 1 : 1, &strings);
+		anns[i].anno = strings.l;
+		kputsn(a->anno ? a->anno : "", a->anno ? strlen(a->anno) + 1 : 1, &strings);
+	}
+	if (bns->n_seqs > 0 && NULL == strings.s) {
+		free(anns);
+		return RAPI_MEMORY_ERROR;
+	}
+
+	const void* data[N_SNAP_SECTIONS];
+	data[SNAP_CNT_TABLE] = bwt->cnt_table;  header.sections[SNAP_CNT_TABLE].size = sizeof(bwt->cnt_table);
+	data[SNAP_BWT] = bwt->bwt;              header.sections[SNAP_BWT].size = bwt->bwt_size * sizeof(uint32_t);
+	data[SNAP_SA] = bwt->sa;                header.sections[SNAP_SA].size = bwt->n_sa * sizeof(bwtint_t);
+	data[SNAP_PAC] = ref->idx->pac;         header.sections[SNAP_PAC].size = bns->l_pac / 4 + 1;
+	data[SNAP_ANNS] = anns;                 header.sections[SNAP_ANNS].size = bns->n_seqs * sizeof(snapshot_ann);
+	data[SNAP_AMBS] = bns->ambs;            header.sections[SNAP_AMBS].size = bns->n_holes * sizeof(bntamb1_t);
+	data[SNAP_STRINGS] = strings.s;         header.sections[SNAP_STRINGS].size = strings.l;
+
+	uint64_t offset = sizeof(header);
+	for (int i = 0; i < N_SNAP_SECTIONS; ++i) {
+		offset = _snapshot_align(offset);
+		header.sections[i].offset = offset;
+		offset += header.sections[i].size;
+	}
+
+	int error = RAPI_NO_ERROR;
+	FILE* fp = fopen(path, "wb");
+	if (NULL == fp) {
+		fprintf(stderr, "Unable to open %s for writing: %s\n", path, strerror(errno));
+		error = RAPI_GENERIC_ERROR;
+	}
+	else {
+		if (fwrite(&header, sizeof(header), 1, fp) != 1)
+			error = RAPI_GENERIC_ERROR;
+		for (int i = 0; i < N_SNAP_SECTIONS && !error; ++i)
+			error = _write_section(fp, header.sections + i, data[i]);
+		if (fclose(fp) != 0 && !error)
+			error = RAPI_GENERIC_ERROR;
+		if (error) {
+			fprintf(stderr, "Error writing snapshot %s\n", path);
+			unlink(path);
+		}
+	}
+
+	free(anns);
+	free(strings.s);
+	return error;
+}
+
+/* Check that the snapshot's sections are where and as big as the header says. */
+static int _check_snapshot(const snapshot_header* h, size_t file_size)
+{
+	if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0)
+		return 0;
+	if (h->version != SNAPSHOT_VERSION || h->header_size != sizeof(*h)
+	 || h->byte_order != SNAPSHOT_BYTE_ORDER || h->amb_size != sizeof(bntamb1_t))
+		return 0;
+	if (h->sa_intv == 0 || h->l_pac < 0 || h->n_seqs < 0 || h->n_holes < 0)
+		return 0;
+
+	const uint64_t expected[N_SNAP_SECTIONS] = {
+		[SNAP_CNT_TABLE] = sizeof(((bwt_t*)0)->cnt_table),
+		[SNAP_BWT] = h->bwt_size * sizeof(uint32_t),
+		[SNAP_SA] = h->n_sa * sizeof(bwtint_t),
+		[SNAP_PAC] = h->l_pac / 4 + 1,
+		[SNAP_ANNS] = h->n_seqs * sizeof(snapshot_ann),
+		[SNAP_AMBS] = h->n_holes * sizeof(bntamb1_t),
+		[SNAP_STRINGS] = h->sections[SNAP_STRINGS].size
+	};
+	for (int i = 0; i < N_SNAP_SECTIONS; ++i) {
+		const snapshot_section* s = h->sections + i;
+		if (s->size != expected[i] || s->offset % SNAPSHOT_ALIGN != 0
+		 || s->offset > file_size || s->size > file_size - s->offset)
+			return 0;
+	}
+	return 1;
+}
+
+static int _load_snapshot(const char* path, int flags, bwa_ref** ret_ref)
+{
+	bwa_ref* ref = _new_ref(RAPI_REF_LOAD_MMAP | BWA_REF_SNAPSHOT);
+	bwaidx_t* idx = calloc(1, sizeof(*idx));
+	bwt_t* bwt = calloc(1, sizeof(*bwt));
+	bntseq_t* bns = calloc(1, sizeof(*bns));
+	int error = RAPI_NO_ERROR;
+
+	if (!ref || !idx || !bwt || !bns) {
+		error = RAPI_MEMORY_ERROR;
+		goto error;
+	}
+
+	error = _map_file(path, 0, 0, &ref->snapshot_map);
+	if (error)
+		goto error;
+
+	const char* base = ref->snapshot_map.addr;
+	const snapshot_header* h = ref->snapshot_map.addr;
+	if (ref->snapshot_map.len < sizeof(*h) || !_check_snapshot(h, ref->snapshot_map.len)) {
+		fprintf(stderr, "%s is not a valid reference snapshot\n", path);
+		error = RAPI_GENERIC_ERROR;
+		goto error;
+	}
+	const snapshot_section* sections = h->sections;
+
+	bwt->primary = h->primary;
+	memcpy(bwt->L2, h->L2, sizeof(bwt->L2));
+	bwt->seq_len = h->seq_len;
+	bwt->bwt_size = h->bwt_size;
+	bwt->bwt = (uint32_t*)(base + sections[SNAP_BWT].offset);
+	memcpy(bwt->cnt_table, base + sections[SNAP_CNT_TABLE].offset, sizeof(bwt->cnt_table));
+	bwt->sa_intv = h->sa_intv;
+	bwt->n_sa = h->n_sa;
+	bwt->sa = (bwtint_t*)(base + sections[SNAP_SA].offset);
+
+	bns->l_pac = h->l_pac;
+	bns->n_seqs = h->n_seqs;
+	bns->seed = h->seed;
+	bns->n_holes = h->n_holes;
+	bns->ambs = (bntamb1_t*)(base + sections[SNAP_AMBS].offset);
+	bns->anns = calloc(h->n_seqs > 0 ? h->n_seqs : 1, sizeof(bntann1_t));
+	if (NULL == bns->anns) {
+		error = RAPI_MEMORY_ERROR;
+		goto error;
+	}
+	const snapshot_ann* anns = (const snapshot_ann*)(base + sections[SNAP_ANNS].offset);
+	const uint64_t strings_size = sections[SNAP_STRINGS].size;
+	char* strings = (char*)base + sections[SNAP_STRINGS].offset;
+	if (strings_size > 0 && strings[strings_size - 1] != '\0') {
+		fprintf(stderr, "%s is not a valid reference snapshot\n", path);
+		error = RAPI_GENERIC_ERROR;
+		goto error;
+	}
+	for (int i = 0; i < h->n_seqs; ++i) {
+		if (anns[i].name >= strings_size || anns[i].anno >= strings_size) {
+			fprintf(stderr, "%s is not a valid reference snapshot\n", path);
+			error = RAPI_GENERIC_ERROR;
+			goto error;
+		}
+		bntann1_t* a = bns->anns + i;
+		a->offset = anns[i].offset;
+		a->len = anns[i].len;
+		a->n_ambs = anns[i].n_ambs;
+		a->gi = anns[i].gi;
+		a->name = strings + anns[i].name;
+		a->anno = strings + anns[i].anno;
+	}
+
+	idx->bwt = bwt;
+	idx->bns = bns;
+	idx->pac = (uint8_t*)(base + sections[SNAP_PAC].offset);
+	ref->idx = idx;
+	_set_loaded(ref);
+	*ret_ref = ref;
+	return RAPI_NO_ERROR;
+
+error:
+	if (bns)
+		free(bns->anns);
+	free(bns);
+	free(bwt);
+	free(idx);
+	if (ref) {
+		_unmap(&ref->snapshot_map);
+		_free_ref(ref);
+	}
+	return error;
+}
+
+/******** Loading and freeing *******/
+
+static int _load_index(const char* path, int flags, bwa_ref** ret_ref)
+{
+	bwa_ref* ref = _new_ref(flags);
+	if (NULL == ref)
+		return RAPI_MEMORY_ERROR;
+
+	if (flags & (RAPI_REF_LOAD_MMAP | RAPI_REF_LOAD_HUGEPAGES)) {
+		// _load_data maps the files or reads them onto huge pages
+		int error = _load_metadata(path, ref);
+		if (!error)
+			error = _load_data(ref);
+		if (error) {
+			_destroy_ref(ref);
+			return error;
+		}
+	}
+	else {
+		ref->idx = bwa_idx_load(path, BWA_IDX_ALL);
+		if (NULL == ref->idx) {
+			_free_ref(ref);
+			return RAPI_GENERIC_ERROR;
+		}
+	}
+
+	_replicate_index(ref);
+	_set_loaded(ref);
+	*ret_ref = ref;
+	return RAPI_NO_ERROR;
+}
+
+/******** Background loading *******/
+
+/*
+ * rapi_ref_load_async loads the contig annotations (which rapi_ref needs
+ * right away, and are small) and then leaves the rest to a thread.  The
+ * thread reads the BWT, SA and pac in chunks, updating the byte counts in
+ * ref->progress as it goes.  For mapped indices, it faults the mappings in
+ * instead, so that alignment doesn't then stall on disk reads.
+ */
+#define LOAD_CHUNK_SIZE ((size_t)64 << 20)
+
+static inline int _load_cancelled(bwa_ref* ref)
+{
+	return __sync_fetch_and_add(&ref->cancel, 0);
+}
+
+static int _read_chunked(bwa_ref* ref, FILE* fp, void* dst, size_t size, rapi_load_progress* progress)
+{
+	for (size_t done = 0; done < size; ) {
+		if (_load_cancelled(ref))
+			return RAPI_GENERIC_ERROR;
+		const size_t n = size - done < LOAD_CHUNK_SIZE ? size - done : LOAD_CHUNK_SIZE;
+		if (fread((char*)dst + done, 1, n, fp) != n)
+			return RAPI_GENERIC_ERROR;
+		done += n;
+		__sync_fetch_and_add(&progress->loaded, n);
+	}
+	return RAPI_NO_ERROR;
+}
+
+static int _prefault(bwa_ref* ref, const index_mapping* map, rapi_load_progress* progress)
+{
+	const size_t page_size = sysconf(_SC_PAGESIZE);
+	const volatile char* data = map->addr;
+
+	for (size_t done = 0; done < map->len; ) {
+		if (_load_cancelled(ref))
+			return RAPI_GENERIC_ERROR;
+		const size_t n = map->len - done < LOAD_CHUNK_SIZE ? map->len - done : LOAD_CHUNK_SIZE;
+		madvise((char*)map->addr + done, n, MADV_WILLNEED);
+		for (size_t offset = 0; offset < n; offset += page_size)
+			(void)data[done + offset];
+		done += n;
+		__sync_fetch_and_add(&progress->loaded, n);
+	}
+	return RAPI_NO_ERROR;
+}
+
+/* What bwt_restore_bwt, bwt_restore_sa and bwa_idx_load do, in chunks */
+static int _read_index(bwa_ref* ref)
+{
+	const size_t fn_len = strlen(ref->prefix) + 10;
+	char* fn = malloc(fn_len);
+	bwt_t* bwt = calloc(1, sizeof(*bwt));
+	FILE* fp = NULL;
+	int error = RAPI_GENERIC_ERROR;
+
+	if (NULL == fn || NULL == bwt) {
+		error = RAPI_MEMORY_ERROR;
+		goto error;
+	}
+
+	// BWT
+	snprintf(fn, fn_len, "%s.bwt", ref->prefix);
+	if (NULL == (fp = fopen(fn, "rb")))
+		goto error;
+	bwt->bwt_size = ref->progress.bwt.total >> 2;
+	bwt->bwt = _alloc_array(ref, bwt->bwt_size * sizeof(uint32_t), &ref->bwt_map);
+	if (NULL == bwt->bwt) {
+		error = RAPI_MEMORY_ERROR;
+		goto error;
+	}
+	if (fread(&bwt->primary, sizeof(bwtint_t), 1, fp) != 1 || fread(bwt->L2 + 1, sizeof(bwtint_t), 4, fp) != 4)
+		goto error;
+	if ((error = _read_chunked(ref, fp, bwt->bwt, bwt->bwt_size * sizeof(uint32_t), &ref->progress.bwt)))
+		goto error;
+	bwt->seq_len = bwt->L2[4];
+	bwt_gen_cnt_table(bwt);
+	fclose(fp);
+
+	// SA
+	error = RAPI_GENERIC_ERROR;
+	snprintf(fn, fn_len, "%s.sa", ref->prefix);
+	if (NULL == (fp = fopen(fn, "rb")))
+		goto error;
+	bwtint_t header[7];
+	if (fread(header, sizeof(bwtint_t), 7, fp) != 7)
+		goto error;
+	if (header[0] != bwt->primary || header[6] != bwt->seq_len || header[5] == 0) {
+		fprintf(stderr, "SA-BWT inconsistency in %s\n", fn);
+		goto error;
+	}
+	bwt->sa_intv = header[5];
+	bwt->n_sa = (bwt->seq_len + bwt->sa_intv) / bwt->sa_intv;
+	ref->progress.sa.total = (bwt->n_sa - 1) * sizeof(bwtint_t);
+	bwt->sa = _alloc_array(ref, bwt->n_sa * sizeof(bwtint_t), &ref->sa_map);
+	if (NULL == bwt->sa) {
+		error = RAPI_MEMORY_ERROR;
+		goto error;
+	}
+	bwt->sa[0] = (bwtint_t)-1;
+	if ((error = _read_chunked(ref, fp, bwt->sa + 1, (bwt->n_sa - 1) * sizeof(bwtint_t), &ref->progress.sa)))
+		goto error;
+	fclose(fp);
+	fp = NULL;
+
+	// pac
+	error = RAPI_GENERIC_ERROR;
+	snprintf(fn, fn_len, "%s.pac", ref->prefix);
+	if (NULL == (fp = fopen(fn, "rb")))
+		goto error;
+	const bntseq_t* bns = ref->idx->bns;
+	uint8_t* pac = _alloc_array(ref, bns->l_pac / 4 + 1, &ref->pac_map);
+	if (NULL == pac) {
+		error = RAPI_MEMORY_ERROR;
+		goto error;
+	}
+	error = _read_chunked(ref, fp, pac, bns->l_pac / 4 + 1, &ref->progress.pac);
+	if (error) {
+		_free_array(ref, pac, &ref->pac_map);
+		goto error;
+	}
+	fclose(fp);
+
+	ref->idx->bwt = bwt;
+	ref->idx->pac = pac;
+	free(fn);
+	return RAPI_NO_ERROR;
+
+error:
+	if (fp)
+		fclose(fp);
+	if (bwt) {
+		_free_array(ref, bwt->bwt, &ref->bwt_map);
+		_free_array(ref, bwt->sa, &ref->sa_map);
+		free(bwt);
+	}
+	free(fn);
+	return error;
+}
+
+static void* _load_thread(void* arg)
+{
+	bwa_ref* ref = arg;
+	int error;
+
+	if (ref->flags & RAPI_REF_LOAD_MMAP) {
+		error = _prefault(ref, &ref->bwt_map, &ref->progress.bwt);
+		if (!error)
+			error = _prefault(ref, &ref->sa_map, &ref->progress.sa);
+		if (!error)
+			error = _prefault(ref, &ref->pac_map, &ref->progress.pac);
+	}
+	else
+		error = _read_index(ref);
+	if (!error)
+		_replicate_index(ref);
+
+	pthread_mutex_lock(&ref->load_lock);
+	ref->load_error = error;
+	ref->progress.ready = 1;
+	pthread_cond_broadcast(&ref->load_cond);
+	pthread_mutex_unlock(&ref->load_lock);
+	return NULL;
+}
+
+/* Set the progress totals of an index to be read into the heap */
+static int _set_read_totals(bwa_ref* ref)
+{
+	const size_t fn_len = strlen(ref->prefix) + 10;
+	char* fn = malloc(fn_len);
+	if (NULL == fn)
+		return RAPI_MEMORY_ERROR;
+
+	int error = RAPI_NO_ERROR;
+	struct stat st;
+	snprintf(fn, fn_len, "%s.bwt", ref->prefix);
+	if (stat(fn, &st) != 0 || (size_t)st.st_size <= BWT_HEADER_SIZE) {
+		fprintf(stderr, "Index file %s is missing or truncated\n", fn);
+		error = RAPI_GENERIC_ERROR;
+	}
+	else {
+		ref->progress.bwt.total = st.st_size - BWT_HEADER_SIZE;
+		snprintf(fn, fn_len, "%s.sa", ref->prefix);
+		// an estimate, until _read_index reads the header
+		ref->progress.sa.total = (stat(fn, &st) == 0 && (size_t)st.st_size > SA_HEADER_SIZE) ? st.st_size - SA_HEADER_SIZE : 0;
+		ref->progress.pac.total = ref->idx->bns->l_pac / 4 + 1;
+	}
+	free(fn);
+	return error;
+}
+
+/* Get the sizes of the files and the annotations, and start the load thread */
+static int _start_async_load(const char* path, int flags, bwa_ref** ret_ref)
+{
+	bwa_ref* ref = _new_ref(flags & ~RAPI_REF_MMAP_POPULATE);
+	if (NULL == ref)
+		return RAPI_MEMORY_ERROR;
+
+	int error = _load_metadata(path, ref);
+	if (error)
+		goto error;
+
+	if (ref->flags & RAPI_REF_LOAD_MMAP) {
+		if ((error = _map_data(ref)))
+			goto error;
+		ref->progress.bwt.total = ref->bwt_map.len;
+		ref->progress.sa.total = ref->sa_map.len;
+		ref->progress.pac.total = ref->pac_map.len;
+	}
+	else if ((error = _set_read_totals(ref)))
+		goto error;
+
+	if (pthread_create(&ref->loader, NULL, _load_thread, ref) != 0) {
+		error = RAPI_GENERIC_ERROR;
+		goto error;
+	}
+	ref->has_loader = 1;
+	*ret_ref = ref;
+	return RAPI_NO_ERROR;
+
+error:
+	_destroy_ref(ref);
+	return error;
+}
+
+/******** Metadata-only references *******/
+
+/*
+ * With RAPI_REF_LOAD_METADATA only the annotations are loaded.  The rest of
+ * the index is loaded (as the other flags say) by the first
+ * rapi_bwa_ref_wait, which every user of the full index goes through.
+ */
+static int _load_metadata_only(const char* path, int flags, bwa_ref** ret_ref)
+{
+	bwa_ref* ref = _new_ref(flags & ~RAPI_REF_LOAD_METADATA);
+	if (NULL == ref)
+		return RAPI_MEMORY_ERROR;
+
+	int error = _load_metadata(path, ref);
+	if (error) {
+		_destroy_ref(ref);
+		return error;
+	}
+	ref->lazy = 1;
+	*ret_ref = ref;
+	return RAPI_NO_ERROR;
+}
+
+static int _load_data(bwa_ref* ref)
+{
+	if (ref->flags & RAPI_REF_LOAD_MMAP) {
+		int error = _map_data(ref);
+		if (!error) {
+			ref->progress.bwt.total = ref->progress.bwt.loaded = ref->bwt_map.len;
+			ref->progress.sa.total = ref->progress.sa.loaded = ref->sa_map.len;
+			ref->progress.pac.total = ref->progress.pac.loaded = ref->pac_map.len;
+		}
+		return error;
+	}
+	else {
+		int error = _set_read_totals(ref);
+		return error ? error : _read_index(ref);
+	}
+}
+
+static int _load_data_replicated(bwa_ref* ref)
+{
+	int error = _load_data(ref);
+	if (!error)
+		_replicate_index(ref);
+	return error;
+}
+
+int rapi_bwa_ref_wait(bwa_ref* ref)
+{
+	pthread_mutex_lock(&ref->load_lock);
+	if (ref->lazy) {
+		// First use of a metadata-only reference.  Load the rest of it
+		// without the lock, so that progress can be queried meanwhile, while
+		// other callers wait for ready.
+		ref->lazy = 0;
+		pthread_mutex_unlock(&ref->load_lock);
+		const int error = _load_data_replicated(ref);
+		pthread_mutex_lock(&ref->load_lock);
+		ref->load_error = error;
+		ref->progress.ready = 1;
+		pthread_cond_broadcast(&ref->load_cond);
+	}
+	while (!ref->progress.ready)
+		pthread_cond_wait(&ref->load_cond, &ref->load_lock);
+	const int error = ref->load_error;
+	pthread_mutex_unlock(&ref->load_lock);
+	return error;
+}
+
+void rapi_bwa_ref_get_progress(bwa_ref* ref, rapi_ref_progress* progress)
+{
+	pthread_mutex_lock(&ref->load_lock);
+	*progress = ref->progress;
+	pthread_mutex_unlock(&ref->load_lock);
+	// the loaded counts are updated without the lock
+	progress->bwt.loaded = __sync_fetch_and_add(&ref->progress.bwt.loaded, 0);
+	progress->sa.loaded = __sync_fetch_and_add(&ref->progress.sa.loaded, 0);
+	progress->pac.loaded = __sync_fetch_and_add(&ref->progress.pac.loaded, 0);
+}
+
+/******** Page statistics *******/
+
+/*
+ * Add up from /proc/self/smaps how the memory holding the BWT, SA and pac
+ * is backed.  smaps has an entry per mapping:  hugetlb mappings give their
+ * page size, while the transparent huge pages of the others are attributed
+ * to the arrays in proportion to how much of the mapping they cover.
+ */
+int rapi_bwa_ref_get_page_stats(bwa_ref* ref, rapi_ref_page_stats* stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	pthread_mutex_lock(&ref->load_lock);
+	const int loaded = ref->progress.ready && ref->load_error == RAPI_NO_ERROR;
+	pthread_mutex_unlock(&ref->load_lock);
+	if (!loaded)
+		return RAPI_NO_ERROR; // nothing in memory yet
+
+	const bwaidx_t* idx = ref->idx;
+	const uintptr_t begin[3] = { (uintptr_t)idx->bwt->bwt, (uintptr_t)idx->bwt->sa, (uintptr_t)idx->pac };
+	const uint64_t size[3] = {
+		idx->bwt->bwt_size * sizeof(uint32_t), idx->bwt->n_sa * sizeof(bwtint_t), idx->bns->l_pac / 4 + 1 };
+	stats->total = size[0] + size[1] + size[2];
+
+	FILE* fp = fopen("/proc/self/smaps", "r");
+	if (NULL == fp)
+		return RAPI_OP_NOT_SUPPORTED_ERROR;
+
+	char line[512];
+	uint64_t overlap = 0, map_len = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		unsigned long long start, end, kb;
+		if (sscanf(line, "%llx-%llx ", &start, &end) == 2) { // a new mapping
+			overlap = 0;
+			map_len = end - start;
+			for (int i = 0; i < 3; ++i) {
+				const uint64_t b = begin[i] > start ? begin[i] : start;
+				const uint64_t e = begin[i] + size[i] < end ? begin[i] + size[i] : end;
+				if (b < e)
+					overlap += e - b;
+			}
+		}
+		else if (overlap == 0)
+			continue;
+		else if (sscanf(line, "KernelPageSize: %llu kB", &kb) == 1) {
+			if ((kb << 10) == HUGE_PAGE_1G)
+				stats->hugetlb_1g += overlap;
+			else if ((kb << 10) == HUGE_PAGE_2M)
+				stats->hugetlb_2m += overlap;
+		}
+		else if (sscanf(line, "AnonHugePages: %llu kB", &kb) == 1 || sscanf(line, "FilePmdMapped: %llu kB", &kb) == 1)
+			stats->thp += (uint64_t)((double)(kb << 10) * overlap / map_len);
+	}
+	fclose(fp);
+	return RAPI_NO_ERROR;
+}
+
+/******** NUMA replicas *******/
+
+/*
+ * With RAPI_REF_LOAD_NUMA, once the index is loaded its BWT, SA and pac are
+ * copied to the memory of every other NUMA node, so that the worker threads
+ * pinned there do their FM-index lookups, which are latency-bound, in local
+ * memory.  The annotations are small and shared by all the copies.  Copies
+ * that can't be made are only reported:  the nodes without one use idx.
+ */
+#ifdef HAVE_LIBNUMA
+
+static void* _copy_to_node(const void* src, size_t size, int node)
+{
+	void* dst = numa_alloc_onnode(size, node);
+	if (dst)
+		memcpy(dst, src, size);
+	return dst;
+}
+
+static void _free_replica(bwaidx_t* replica)
+{
+	bwt_t* bwt = replica->bwt;
+	if (bwt->bwt)
+		numa_free(bwt->bwt, bwt->bwt_size * sizeof(uint32_t));
+	if (bwt->sa)
+		numa_free(bwt->sa, bwt->n_sa * sizeof(bwtint_t));
+	if (replica->pac)
+		numa_free(replica->pac, replica->bns->l_pac / 4 + 1);
+	free(bwt);
+	free(replica);
+}
+
+static bwaidx_t* _replicate_on_node(const bwaidx_t* idx, int node)
+{
+	bwaidx_t* replica = calloc(1, sizeof(*replica));
+	bwt_t* bwt = malloc(sizeof(*bwt));
+	if (NULL == replica || NULL == bwt) {
+		free(replica);
+		free(bwt);
+		return NULL;
+	}
+	*bwt = *idx->bwt;
+	replica->bwt = bwt;
+	replica->bns = idx->bns;
+	bwt->bwt = _copy_to_node(idx->bwt->bwt, bwt->bwt_size * sizeof(uint32_t), node);
+	bwt->sa = _copy_to_node(idx->bwt->sa, bwt->n_sa * sizeof(bwtint_t), node);
+	replica->pac = _copy_to_node(idx->pac, idx->bns->l_pac / 4 + 1, node);
+	if (NULL == bwt->bwt || NULL == bwt->sa || NULL == replica->pac) {
+		_free_replica(replica);
+		return NULL;
+	}
+	return replica;
+}
+
+static void _replicate_index(bwa_ref* ref)
+{
+	if (!(ref->flags & RAPI_REF_LOAD_NUMA) || numa_available() < 0 || numa_max_node() < 1)
+		return;
+
+	// the node holding (the start of) the BWT doesn't need a copy
+	int home = -1;
+	if (get_mempolicy(&home, NULL, 0, ref->idx->bwt->bwt, MPOL_F_NODE | MPOL_F_ADDR) != 0)
+		home = -1;
+
+	const int n_nodes = numa_max_node() + 1;
+	bwaidx_t** replicas = calloc(n_nodes, sizeof(*replicas));
+	if (NULL == replicas) {
+		fprintf(stderr, "Not enough memory to replicate the index on the NUMA nodes\n");
+		return;
+	}
+	for (int node = 0; node < n_nodes && !_load_cancelled(ref); ++node) {
+		if (node == home || !numa_bitmask_isbitset(numa_all_nodes_ptr, node))
+			continue;
+		replicas[node] = _replicate_on_node(ref->idx, node);
+		if (NULL == replicas[node])
+			fprintf(stderr, "Unable to copy the index to NUMA node %d\n", node);
+	}
+	ref->replicas = replicas;
+	ref->n_replicas = n_nodes;
+}
+
+static void _free_replicas(bwa_ref* ref)
+{
+	for (int node = 0; node < ref->n_replicas; ++node) {
+		if (ref->replicas[node])
+			_free_replica(ref->replicas[node]);
+	}
+	free(ref->replicas);
+}
+
+int rapi_bwa_current_node(void)
+{
+	if (numa_available() < 0)
+		return -1;
+	const int cpu = sched_getcpu();
+	return cpu < 0 ? -1 : numa_node_of_cpu(cpu);
+}
+
+int rapi_bwa_pin_thread(int n)
+{
+	if (numa_available() < 0)
+		return -1;
+	const int n_nodes = numa_num_task_nodes();
+	if (n_nodes < 1)
+		return -1;
+
+	// find the (n % n_nodes)-th node we may run on
+	int k = n % n_nodes;
+	for (int node = 0; node <= numa_max_node(); ++node) {
+		if (!numa_bitmask_isbitset(numa_all_nodes_ptr, node))
+			continue;
+		if (k-- == 0)
+			return numa_run_on_node(node) == 0 ? node : -1;
+	}
+	return -1;
+}
+
+#else
+
+static void _replicate_index(bwa_ref* ref) { }
+static void _free_replicas(bwa_ref* ref) { }
+int rapi_bwa_current_node(void) { return -1; }
+int rapi_bwa_pin_thread(int n) { return -1; }
+
+#endif
+
+/******** Freeing *******/
+
+static void _destroy_ref(bwa_ref* ref)
+{
+	if (ref->has_loader) {
+		__sync_fetch_and_add(&ref->cancel, 1);
+		pthread_join(ref->loader, NULL);
+	}
+	_free_replicas(ref);
+
+	if (ref->flags & BWA_REF_SNAPSHOT) {
+		// everything but these structures lives in the snapshot mapping
+		free(ref->idx->bwt);
+		free(ref->idx->bns->anns);
+		free(ref->idx->bns);
+		free(ref->idx);
+		_unmap(&ref->snapshot_map);
+	}
+	else if (ref->flags & (RAPI_REF_LOAD_MMAP | RAPI_REF_LOAD_HUGEPAGES)) {
+		// only the bwt_t structure and the annotations are on the heap
+		if (ref->idx) {
+			free(ref->idx->bwt);
+			bns_destroy(ref->idx->bns);
+			free(ref->idx);
+		}
+		_unmap(&ref->bwt_map);
+		_unmap(&ref->sa_map);
+		_unmap(&ref->pac_map);
+	}
+	else if (ref->idx)
+		bwa_idx_destroy(ref->idx);
+	_free_ref(ref);
+}
+
+/******** Registry *******/
+
+/*
+ * All the loaded indices in the process, so that loading the same one again
+ * (even through a different path) shares it rather than loading a second
+ * copy.  An index is identified by the canonical path and the identity
+ * (device, inode, size and modification time) of its main file:  the .bwt
+ * file or the snapshot.  The first load decides how an index is held, so a
+ * later RAPI_REF_LOAD_MMAP request may get an index that was read into the
+ * heap, or vice versa.
+ *
+ * Loads run without the registry lock, so that they don't hold up loads of
+ * other indices or rapi_bwa_ref_free.  While an index is being loaded it has
+ * an entry in `pending`, and concurrent loads of the same index wait for
+ * that one to finish instead of duplicating it.  For background loads the
+ * pending entry only lasts while they start;  a synchronous load that finds
+ * the index still loading in the background waits for it, while entries
+ * whose background load failed are skipped.
+ */
+typedef int (*ref_loader)(const char* path, int flags, bwa_ref** ret_ref);
+
+/* A load in progress, with the threads waiting for it */
+typedef struct pending_load {
+	const ref_identity* id;
+	int done;
+	int error;
+	int n_waiters;
+	struct pending_load* next;
+} pending_load;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t registry_cond = PTHREAD_COND_INITIALIZER; // signalled when a pending load is done
+static bwa_ref* registry = NULL;
+static pending_load* pending = NULL;
+
+static int _ref_identity(const char* id_file, ref_identity* id)
+{
+	struct stat st;
+	if (stat(id_file, &st) != 0) {
+		fprintf(stderr, "Unable to stat %s: %s\n", id_file, strerror(errno));
+		return RAPI_GENERIC_ERROR;
+	}
+	id->path = realpath(id_file, NULL);
+	if (NULL == id->path)
+		return RAPI_MEMORY_ERROR;
+	id->dev = st.st_dev;
+	id->ino = st.st_ino;
+	id->size = st.st_size;
+	id->mtime = st.st_mtime;
+	return RAPI_NO_ERROR;
+}
+
+static inline int _same_identity(const ref_identity* a, const ref_identity* b)
+{
+	return a->dev == b->dev && a->ino == b->ino && a->size == b->size && a->mtime == b->mtime
+	    && strcmp(a->path, b->path) == 0;
+}
+
+static int _registry_load(const char* path, const char* id_file, int flags, ref_loader loader, int wait, bwa_ref** ret_ref)
+{
+	ref_identity id;
+	int error = _ref_identity(id_file, &id);
+	if (error)
+		return error;
+
+	pthread_mutex_lock(&registry_lock);
+	bwa_ref* ref;
+	while (1) {
+		for (ref = registry; ref != NULL; ref = ref->next) {
+			if (_same_identity(&ref->id, &id)) {
+				pthread_mutex_lock(&ref->load_lock);
+				const int failed = ref->progress.ready && ref->load_error;
+				pthread_mutex_unlock(&ref->load_lock);
+				if (!failed)
+					break;
+			}
+		}
+		if (ref)
+			break;
+
+		pending_load* p = pending;
+		while (p != NULL && !_same_identity(p->id, &id))
+			p = p->next;
+		if (NULL == p)
+			break;
+
+		// wait for the other load, then look for its index again
+		p->n_waiters += 1;
+		while (!p->done)
+			pthread_cond_wait(&registry_cond, &registry_lock);
+		error = p->error;
+		if (--p->n_waiters == 0)
+			free(p);
+		if (error) {
+			pthread_mutex_unlock(&registry_lock);
+			free(id.path);
+			return error;
+		}
+	}
+
+	if (ref) {
+		ref->refcount += 1;
+		pthread_mutex_unlock(&registry_lock);
+		free(id.path);
+	}
+	else {
+		pending_load* p = calloc(1, sizeof(*p));
+		if (NULL == p) {
+			pthread_mutex_unlock(&registry_lock);
+			free(id.path);
+			return RAPI_MEMORY_ERROR;
+		}
+		p->id = &id;
+		p->next = pending;
+		pending = p;
+		pthread_mutex_unlock(&registry_lock);
+
+		error = loader(path, flags, &ref);
+
+		pthread_mutex_lock(&registry_lock);
+		pending_load** pp = &pending;
+		while (*pp != p)
+			pp = &(*pp)->next;
+		*pp = p->next;
+		p->done = 1;
+		p->error = error;
+		if (p->n_waiters == 0)
+			free(p);
+		else
+			pthread_cond_broadcast(&registry_cond);
+
+		if (error)
+			free(id.path);
+		else {
+			ref->id = id;
+			ref->refcount = 1;
+			ref->next = registry;
+			registry = ref;
+		}
+		pthread_mutex_unlock(&registry_lock);
+	}
+
+	if (error)
+		return error;
+	if (wait && (error = rapi_bwa_ref_wait(ref))) {
+		rapi_bwa_ref_free(ref);
+		return error;
+	}
+	*ret_ref = ref;
+	return RAPI_NO_ERROR;
+}
+
+/* Find the index's main file, and load the index through the registry */
+static int _registry_load_index(const char* path, int flags, int async, bwa_ref** ret_ref)
+{
+	char* prefix = bwa_idx_infer_prefix(path);
+	if (NULL == prefix) {
+		fprintf(stderr, "Could not locate the index for %s\n", path);
+		return RAPI_GENERIC_ERROR;
+	}
+	char* bwt_file = malloc(strlen(prefix) + 5);
+	if (NULL == bwt_file) {
+		free(prefix);
+		return RAPI_MEMORY_ERROR;
+	}
+	sprintf(bwt_file, "%s.bwt", prefix);
+
+	ref_loader loader = _load_index;
+	if (flags & RAPI_REF_LOAD_METADATA)
+		loader = _load_metadata_only;
+	else if (async)
+		loader = _start_async_load;
+	// metadata-only references are "loaded" when they are first used
+	const int wait = !async && !(flags & RAPI_REF_LOAD_METADATA);
+	int error = _registry_load(path, bwt_file, flags, loader, wait, ret_ref);
+	free(bwt_file);
+	free(prefix);
+	return error;
+}
+
+int rapi_bwa_ref_load(const char* path, int flags, bwa_ref** ret_ref)
+{
+	return _registry_load_index(path, flags, 0, ret_ref);
+}
+
+int rapi_bwa_ref_load_async(const char* path, int flags, bwa_ref** ret_ref)
+{
+	return _registry_load_index(path, flags, 1, ret_ref);
+}
+
+int rapi_bwa_ref_load_snapshot(const char* path, bwa_ref** ret_ref)
+{
+	return _registry_load(path, path, 0, _load_snapshot, 1, ret_ref);
+}
+
+void rapi_bwa_ref_free(bwa_ref* ref)
+{
+	if (NULL == ref)
+		return;
+
+	pthread_mutex_lock(&registry_lock);
+	const int last = --ref->refcount == 0;
+	if (last) {
+		bwa_ref** p = &registry;
+		while (*p != ref)
+			p = &(*p)->next;
+		*p = ref->next;
+	}
+	pthread_mutex_unlock(&registry_lock);
+
+	if (last)
+		_destroy_ref(ref);
+}
+
+/******** Index construction *******/
+
+/*
+ * From BWA's bwtindex.c, which doesn't declare them in a header.
+ */
+extern bwt_t *bwt_pac2bwt(const char *fn_pac, int use_is);
+extern void bwt_bwtupdate_core(bwt_t *bwt);
+
+/*
+ * Above this reference length BWA's `index` command switches from the IS
+ * algorithm to BWT-SW, which is slower on small inputs but needs less
+ * memory and also works on references of 2 Gbp and more.
+ */
+#define BUILD_IS_MAX_LEN  50000000LL
+/* IS works on both strands (2 * l_pac bases) with about 5.37 bytes per base */
+#define BUILD_IS_BYTES_PER_BASE 5.37
+
+typedef struct {
+	const char* fasta_path;
+	const char* prefix;
+	int error;
+} build_pack_job;
+
+/* Rewrite .pac, .ann and .amb with the forward strand only, as the aligner wants them */
+static void* _build_forward_pac(void* arg)
+{
+	build_pack_job* job = arg;
+	gzFile fp = gzopen(job->fasta_path, "r");
+	if (NULL == fp) {
+		job->error = RAPI_GENERIC_ERROR;
+		return NULL;
+	}
+	if (bns_fasta2bntseq(fp, job->prefix, 1) <= 0)
+		job->error = RAPI_GENERIC_ERROR;
+	gzclose(fp);
+	return NULL;
+}
+
+/*
+ * The suffix array sampling of bwt_cal_sa, on several threads.  bwt_cal_sa
+ * walks the whole text backwards with the LF mapping, starting from its
+ * end, the only position whose rank it knows.  Here the text is split into
+ * segments, each walked by its own thread from its last position.  The rank
+ * of that position is found with a backward search of the bases that
+ * follow it, which works as long as they occur only once in the text.
+ */
+#define SA_ANCHOR_LEN   64    // bases searched to find the rank of a segment's start
+#define SA_ANCHOR_TRIES 4096  // positions tried as the start of each segment
+#define SA_PARALLEL_MIN_LEN (1 << 20) // shorter texts are sampled by bwt_cal_sa
+
+typedef struct {
+	bwt_t* bwt;
+	bwtint_t hi;  // walk from text position hi, whose rank is isa...
+	bwtint_t isa;
+	bwtint_t lo;  // ... down to lo
+} sa_segment;
+
+typedef struct {
+	const char* prefix;
+	bwt_t* bwt;              // with the occurrence counts
+	int n_segments;          // 0 to sample with bwt_cal_sa
+	sa_segment* segments;
+	int sa_intv;
+	int error;
+} build_sa_job;
+
+static void* _walk_sa_segment(void* arg)
+{
+	const sa_segment* seg = arg;
+	bwt_t* bwt = seg->bwt;
+	const bwtint_t intv = bwt->sa_intv;
+	bwtint_t isa = seg->isa;
+	for (bwtint_t sa = seg->hi; ; --sa) {
+		if (isa % intv == 0)
+			bwt->sa[isa / intv] = sa;
+		if (sa == seg->lo)
+			break;
+		isa = bwt_invPsi(bwt, isa);
+	}
+	return NULL;
+}
+
+/* The rank of the suffix starting with the `len` bases of s, if they occur only once */
+static int _unique_rank(const bwt_t* bwt, const uint8_t* s, int len, bwtint_t* isa)
+{
+	bwtint_t k = 0, l = bwt->seq_len;
+	for (int i = len - 1; i >= 0 && k <= l; --i) {
+		k = bwt->L2[s[i]] + bwt_occ(bwt, k - 1, s[i]) + 1;
+		l = bwt->L2[s[i]] + bwt_occ(bwt, l, s[i]);
+	}
+	*isa = k;
+	return k == l;
+}
+
+/*
+ * Split the text into up to n segments of about the same length, finding
+ * their starting ranks.  Reads the bases from the .pac file of both
+ * strands, the text of the BWT.  Positions whose bases aren't unique move
+ * the segment boundary forward;  if none is found the segment is merged with
+ * the next one.
+ */
+static int _plan_sa_segments(bwt_t* bwt, const char* fn_pac, int n, sa_segment* segments, int* n_segments)
+{
+	FILE* fp = fopen(fn_pac, "rb");
+	if (NULL == fp) {
+		fprintf(stderr, "Unable to open %s: %s\n", fn_pac, strerror(errno));
+		return RAPI_GENERIC_ERROR;
+	}
+	const int max_bases = SA_ANCHOR_TRIES + SA_ANCHOR_LEN;
+	uint8_t packed[max_bases / 4 + 2];
+	uint8_t bases[max_bases + 4];
+
+	const bwtint_t seq_len = bwt->seq_len;
+	int count = 0;
+	segments[count++] = (sa_segment){ bwt, seq_len, 0, 0 }; // the end of the text has rank 0
+	for (int t = 1; t < n; ++t) {
+		const bwtint_t target = seq_len - seq_len / n * t;
+		bwtint_t avail = seq_len - target < (bwtint_t)max_bases ? seq_len - target : max_bases;
+		const size_t n_bytes = (target + avail + 3) / 4 - target / 4;
+		if (fseeko(fp, target / 4, SEEK_SET) != 0 || fread(packed, 1, n_bytes, fp) != n_bytes) {
+			fprintf(stderr, "Error reading %s\n", fn_pac);
+			fclose(fp);
+			return RAPI_GENERIC_ERROR;
+		}
+		for (bwtint_t i = 0; i < avail; ++i) {
+			const bwtint_t pos = target + i;
+			bases[i] = packed[pos / 4 - target / 4] >> ((~pos & 3) << 1) & 3;
+		}
+
+		sa_segment* prev = &segments[count - 1];
+		for (bwtint_t i = 0; i + SA_ANCHOR_LEN <= avail && target + i < prev->hi; ++i) {
+			bwtint_t isa;
+			if (_unique_rank(bwt, bases + i, SA_ANCHOR_LEN, &isa)) {
+				prev->lo = target + i + 1;
+				segments[count++] = (sa_segment){ bwt, target + i, isa, 0 };
+				break;
+			}
+		}
+	}
+	fclose(fp);
+	*n_segments = count;
+	return RAPI_NO_ERROR;
+}
+
+/* Sample the suffix array from the finished BWT and write the .sa file */
+static void* _build_sa(void* arg)
+{
+	build_sa_job* job = arg;
+	bwt_t* bwt = job->bwt;
+
+	if (job->n_segments > 1) {
+		free(bwt->sa);
+		bwt->sa_intv = job->sa_intv;
+		bwt->n_sa = (bwt->seq_len + job->sa_intv) / job->sa_intv;
+		bwt->sa = calloc(bwt->n_sa, sizeof(bwtint_t));
+		pthread_t* threads = calloc(job->n_segments, sizeof(pthread_t));
+		if (NULL == bwt->sa || NULL == threads) {
+			free(threads);
+			job->error = RAPI_MEMORY_ERROR;
+			return NULL;
+		}
+		// the first segment runs on this thread, or on any that couldn't be started
+		int started[job->n_segments];
+		for (int i = 1; i < job->n_segments; ++i)
+			started[i] = pthread_create(&threads[i], NULL, _walk_sa_segment, &job->segments[i]) == 0;
+		_walk_sa_segment(&job->segments[0]);
+		for (int i = 1; i < job->n_segments; ++i) {
+			if (started[i])
+				pthread_join(threads[i], NULL);
+			else
+				_walk_sa_segment(&job->segments[i]);
+		}
+		free(threads);
+		bwt->sa[0] = (bwtint_t)-1; // as bwt_cal_sa does
+	}
+	else
+		bwt_cal_sa(bwt, job->sa_intv);
+
+	const size_t fn_len = strlen(job->prefix) + 10;
+	char fn[fn_len];
+	snprintf(fn, fn_len, "%s.sa", job->prefix);
+	bwt_dump_sa(fn, bwt);
+	return NULL;
+}
+
+/*
+ * BWA exits the process if it can't open an output file, so make sure
+ * that all the index files can be written before starting.  Files that
+ * didn't exist are removed again.
+ */
+static int _check_writable(const char* prefix)
+{
+	static const char* const exts[] = { "pac", "ann", "amb", "bwt", "sa" };
+	const size_t fn_len = strlen(prefix) + 10;
+	char fn[fn_len];
+
+	for (size_t i = 0; i < sizeof(exts) / sizeof(exts[0]); ++i) {
+		snprintf(fn, fn_len, "%s.%s", prefix, exts[i]);
+		const int existed = access(fn, F_OK) == 0;
+		FILE* fp = fopen(fn, "ab");
+		if (NULL == fp) {
+			fprintf(stderr, "Can't write index file %s: %s\n", fn, strerror(errno));
+			return RAPI_GENERIC_ERROR;
+		}
+		fclose(fp);
+		if (!existed)
+			unlink(fn);
+	}
+	return RAPI_NO_ERROR;
+}
+
+int rapi_ref_build_sampled(const char* fasta_path, const char* out_prefix, int n_threads, size_t mem_budget, int sa_intv)
+{
+	// bwt_cal_sa only takes powers of 2, and exits otherwise
+	if (NULL == fasta_path || NULL == out_prefix || sa_intv <= 0 || (sa_intv & (sa_intv - 1)) != 0)
+		return RAPI_PARAM_ERROR;
+
+	int error = _check_writable(out_prefix);
+	if (error)
+		return error;
+
+	const size_t fn_len = strlen(out_prefix) + 10;
+	char fn_pac[fn_len], fn_bwt[fn_len];
+	snprintf(fn_pac, fn_len, "%s.pac", out_prefix);
+	snprintf(fn_bwt, fn_len, "%s.bwt", out_prefix);
+
+	// Pack both strands of the reference, as the BWT is built on them
+	gzFile fp = gzopen(fasta_path, "r");
+	if (NULL == fp) {
+		fprintf(stderr, "Unable to open %s\n", fasta_path);
+		return RAPI_GENERIC_ERROR;
+	}
+	const int64_t l_pac = bns_fasta2bntseq(fp, out_prefix, 0);
+	gzclose(fp);
+	if (l_pac <= 0) {
+		fprintf(stderr, "No reference sequence found in %s\n", fasta_path);
+		return RAPI_GENERIC_ERROR;
+	}
+
+	// Choose the BWT construction algorithm.  Both are single-threaded.
+	int use_is = l_pac <= BUILD_IS_MAX_LEN;
+	if (mem_budget > 0)
+		use_is = 2 * l_pac < INT32_MAX && BUILD_IS_BYTES_PER_BASE * 2 * l_pac <= (double)mem_budget;
+	if (use_is) {
+		bwt_t* bwt = bwt_pac2bwt(fn_pac, 1);
+		bwt_dump_bwt(fn_bwt, bwt);
+		bwt_destroy(bwt);
+	}
+	else
+		bwt_bwtgen(fn_pac, fn_bwt);
+
+	// Add the occurrence counts to the BWT, and keep it for the SA
+	bwt_t* bwt = bwt_restore_bwt(fn_bwt);
+	bwt_bwtupdate_core(bwt);
+	bwt_dump_bwt(fn_bwt, bwt);
+
+	// Plan the parallel SA sampling while .pac still holds both strands
+	if (n_threads < 1)
+		n_threads = 1;
+	sa_segment segments[n_threads];
+	build_sa_job sa_job = { out_prefix, bwt, 0, segments, sa_intv, RAPI_NO_ERROR };
+	if (n_threads > 1 && bwt->seq_len >= SA_PARALLEL_MIN_LEN
+	    && (error = _plan_sa_segments(bwt, fn_pac, n_threads, segments, &sa_job.n_segments))) {
+		bwt_destroy(bwt);
+		return error;
+	}
+
+	// The last two steps are independent:  one only reads the FASTA again
+	// and writes .pac, .ann and .amb, the other samples the SA and writes .sa.
+	build_pack_job pack_job = { fasta_path, out_prefix, RAPI_NO_ERROR };
+	pthread_t pack_thread;
+	if (n_threads > 1 && pthread_create(&pack_thread, NULL, _build_forward_pac, &pack_job) == 0) {
+		_build_sa(&sa_job);
+		pthread_join(pack_thread, NULL);
+	}
+	else {
+		_build_forward_pac(&pack_job);
+		_build_sa(&sa_job);
+	}
+	bwt_destroy(bwt);
+	return pack_job.error ? pack_job.error : sa_job.error;
+}
+
+int rapi_ref_build(const char* fasta_path, const char* out_prefix, int n_threads, size_t mem_budget)
+{
+	return rapi_ref_build_sampled(fasta_path, out_prefix, n_threads, mem_budget, RAPI_REF_BUILD_SA_INTV);
+}
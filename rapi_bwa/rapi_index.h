@@ -0,0 +1,140 @@
+/*
+ * rapi_index.h
+ *
+ * Reference index handling for the BWA plugin.  Internal to the plugin:
+ * not part of the RAPI interface.
+ */
+
+#ifndef __RAPI_INDEX_H__
+#define __RAPI_INDEX_H__
+
+#include <rapi.h>
+#include <bwa.h>
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* A region of an index file mapped into memory, or of anonymous memory */
+typedef struct {
+	void* addr;
+	size_t len;
+} index_mapping;
+
+/* Identity of the main file of an index, used to share loaded indices */
+typedef struct {
+	char* path; // canonical
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+} ref_identity;
+
+/* Internal flag, added to bwa_ref.flags when the index comes from a snapshot */
+#define BWA_REF_SNAPSHOT 0x100
+
+/*
+ * What the plugin keeps in rapi_ref._private.  Depending on how the index
+ * was loaded, the BWT, SA and packed reference in `idx` are either heap
+ * allocated by BWA or point into the file mappings.
+ */
+typedef struct bwa_ref {
+	bwaidx_t* idx;
+	int flags; // RAPI_REF_LOAD_* flags used to load idx
+	// unique to this bwa_ref in the process, unlike its address, which may
+	// be reused once it's freed.  Identifies the index to caches.
+	uint64_t generation;
+	index_mapping bwt_map;
+	index_mapping sa_map;
+	index_mapping pac_map;
+	index_mapping snapshot_map;
+
+	// background loading (see rapi_ref_load_async).  progress.ready and
+	// load_error are protected by load_lock
+	char* prefix;
+	int lazy; // only the metadata is loaded (RAPI_REF_LOAD_METADATA)
+	rapi_ref_progress progress;
+	int load_error;
+	int cancel;
+	int has_loader;
+	pthread_t loader;
+	pthread_mutex_t load_lock;
+	pthread_cond_t load_cond;
+
+	// copies of idx on the NUMA nodes (RAPI_REF_LOAD_NUMA), indexed by
+	// node.  NULL entries (such as the node holding idx) use idx
+	int n_replicas;
+	bwaidx_t** replicas;
+
+	// registry of the loaded indices
+	ref_identity id;
+	int refcount;
+	struct bwa_ref* next;
+} bwa_ref;
+
+/*
+ * The index of a loaded reference.  For references loaded in the
+ * background, only the annotations (idx->bns) can be used before
+ * rapi_bwa_ref_wait returns.
+ */
+static inline bwaidx_t* _ref_idx(const rapi_ref* ref) {
+	return ((const bwa_ref*)ref->_private)->idx;
+}
+
+/*
+ * The copy of the index on NUMA node `node`, or the loaded one if there's
+ * none there (or node is -1).
+ */
+static inline bwaidx_t* _ref_idx_node(const rapi_ref* ref, int node) {
+	const bwa_ref* r = ref->_private;
+	if (node >= 0 && node < r->n_replicas && r->replicas[node])
+		return r->replicas[node];
+	return r->idx;
+}
+
+/* The NUMA node the calling thread is running on, or -1 if unknown */
+int rapi_bwa_current_node(void);
+
+/*
+ * Pin the calling thread to the n-th NUMA node, going round robin over the
+ * nodes.  Return the node, or -1 if the thread couldn't be pinned.
+ */
+int rapi_bwa_pin_thread(int n);
+
+/*
+ * Load the BWA index at `path` as requested by the RAPI_REF_LOAD_* `flags`.
+ * If the index is already loaded in the process, the same bwa_ref is
+ * returned with its reference count incremented;  rapi_bwa_ref_free
+ * releases it.
+ */
+int rapi_bwa_ref_load(const char* path, int flags, bwa_ref** ret_ref);
+
+/*
+ * Like rapi_bwa_ref_load, but return once the annotations are loaded,
+ * loading the rest of the index in a background thread.
+ */
+int rapi_bwa_ref_load_async(const char* path, int flags, bwa_ref** ret_ref);
+
+/*
+ * Wait until the index is fully loaded, loading it now if it was opened
+ * with RAPI_REF_LOAD_METADATA.  Return the load's error code.
+ */
+int rapi_bwa_ref_wait(bwa_ref* ref);
+
+void rapi_bwa_ref_get_progress(bwa_ref* ref, rapi_ref_progress* progress);
+
+/* Find which pages hold the index (see rapi_ref_get_page_stats) */
+int rapi_bwa_ref_get_page_stats(bwa_ref* ref, rapi_ref_page_stats* stats);
+
+/* Write the whole index to a single snapshot file (see rapi_index.c) */
+int rapi_bwa_ref_save_snapshot(const bwa_ref* ref, const char* path);
+
+/* Load an index from a snapshot file written by rapi_bwa_ref_save_snapshot */
+int rapi_bwa_ref_load_snapshot(const char* path, bwa_ref** ret_ref);
+
+/* Release a reference to `ref`, destroying it with the last one. */
+void rapi_bwa_ref_free(bwa_ref* ref);
+
+#endif
@@ -0,0 +1,216 @@
+/*
+ * rapi_pestat.c
+ *
+ * BWA's mem_pestat estimates the insert-size distribution from scratch on
+ * each batch, from the pairs in that batch alone.  Small batches give a
+ * noisy estimate, or none at all, and then mate rescue and pairing don't
+ * work properly.
+ *
+ * Here the insert sizes of the unique pairs are instead added to
+ * histograms that persist across batches, and the estimate is computed
+ * from them with the same rules as mem_pestat in BWA 0.7.8.
+ */
+
+#include "rapi_pestat.h"
+
+#include <rapi.h>
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* From BWA's bwamem_pair.c */
+#define MIN_RATIO     0.8
+#define MIN_DIR_CNT   10
+#define MIN_DIR_RATIO 0.05
+#define OUTLIER_BOUND 2.0
+#define MAPPING_BOUND 3.0
+#define MAX_STDDEV    4.0
+
+/* The estimate is frozen once a batch changes its means and std devs by less than this, relatively... */
+#define PESTAT_TOLERANCE   0.005
+/* ... and it's based on at least this many pairs */
+#define PESTAT_MIN_FREEZE  10000
+/* A seeded estimate is replaced by the computed one after this many pairs */
+#define PESTAT_MIN_REPLACE 1000
+
+/* Defined in BWA's bwamem_pair.c */
+extern int mem_infer_dir(int64_t l_pac, int64_t b1, int64_t b2, int64_t *dist);
+
+void rapi_bwa_pestat_init(pestat_acc* acc)
+{
+	memset(acc, 0, sizeof(*acc));
+}
+
+void rapi_bwa_pestat_free(pestat_acc* acc)
+{
+	for (int d = 0; d < 4; ++d)
+		free(acc->hist[d]);
+	memset(acc, 0, sizeof(*acc));
+}
+
+void rapi_bwa_pestat_seed(pestat_acc* acc, double avg, double std, int freeze)
+{
+	memset(acc->pes, 0, sizeof(acc->pes));
+	for (int d = 0; d < 4; ++d)
+		acc->pes[d].failed = 1;
+
+	mem_pestat_t* fr = &acc->pes[1];
+	fr->failed = 0;
+	fr->avg = avg;
+	fr->std = std;
+	fr->high = (int)(avg + MAX_STDDEV * std + .499);
+	fr->low = (int)(avg - MAX_STDDEV * std + .499);
+	if (fr->low < 1)
+		fr->low = 1;
+	acc->has_estimate = acc->seeded = 1;
+	acc->frozen = freeze != 0;
+}
+
+/* Start new histograms if max_ins has changed */
+static int _reset_histograms(pestat_acc* acc, int max_ins)
+{
+	for (int d = 0; d < 4; ++d) {
+		free(acc->hist[d]);
+		acc->hist[d] = NULL;
+		acc->n[d] = 0;
+	}
+	acc->max_ins = 0;
+	for (int d = 0; d < 4; ++d) {
+		acc->hist[d] = calloc(max_ins + 1, sizeof(uint64_t));
+		if (NULL == acc->hist[d])
+			return RAPI_MEMORY_ERROR;
+	}
+	acc->max_ins = max_ins;
+	return RAPI_NO_ERROR;
+}
+
+/* cal_sub from bwamem_pair.c:  the score of the best hit overlapping the top one */
+static int _cal_sub(const mem_opt_t* opt, const mem_alnreg_v* r)
+{
+	int j;
+	for (j = 1; j < r->n; ++j) { // choose unique alignment
+		int b_max = r->a[j].qb > r->a[0].qb ? r->a[j].qb : r->a[0].qb;
+		int e_min = r->a[j].qe < r->a[0].qe ? r->a[j].qe : r->a[0].qe;
+		if (e_min > b_max) { // have overlap
+			int min_l = r->a[j].qe - r->a[j].qb < r->a[0].qe - r->a[0].qb ? r->a[j].qe - r->a[j].qb : r->a[0].qe - r->a[0].qb;
+			if (e_min - b_max >= min_l * opt->mask_level)
+				break; // significant overlap
+		}
+	}
+	return j < r->n ? r->a[j].score : opt->min_seed_len * opt->a;
+}
+
+/* The insert size of the given rank (0-based) in histogram h */
+static int _rank_value(const uint64_t* h, int max_ins, uint64_t rank)
+{
+	uint64_t seen = 0;
+	for (int v = 1; v <= max_ins; ++v) {
+		seen += h[v];
+		if (seen > rank)
+			return v;
+	}
+	return max_ins;
+}
+
+/* The body of mem_pestat, on the histograms */
+static void _estimate(const pestat_acc* acc, mem_pestat_t pes[4])
+{
+	uint64_t max = 0;
+	memset(pes, 0, 4 * sizeof(mem_pestat_t));
+
+	for (int d = 0; d < 4; ++d) {
+		mem_pestat_t* r = &pes[d];
+		const uint64_t* h = acc->hist[d];
+		const uint64_t n = acc->n[d];
+		max = n > max ? n : max;
+		if (n < MIN_DIR_CNT) {
+			r->failed = 1;
+			continue;
+		}
+		const int p25 = _rank_value(h, acc->max_ins, (uint64_t)(.25 * n + .499));
+		const int p75 = _rank_value(h, acc->max_ins, (uint64_t)(.75 * n + .499));
+		r->low  = (int)(p25 - OUTLIER_BOUND * (p75 - p25) + .499);
+		if (r->low < 1) r->low = 1;
+		r->high = (int)(p75 + OUTLIER_BOUND * (p75 - p25) + .499);
+		if (r->high > acc->max_ins) r->high = acc->max_ins;
+
+		double sum = 0, x = 0;
+		for (int v = r->low; v <= r->high; ++v) {
+			sum += (double)v * h[v];
+			x += h[v];
+		}
+		r->avg = sum / x;
+		double var = 0;
+		for (int v = r->low; v <= r->high; ++v)
+			var += h[v] * (v - r->avg) * (v - r->avg);
+		r->std = sqrt(var / x);
+
+		r->low  = (int)(p25 - MAPPING_BOUND * (p75 - p25) + .499);
+		r->high = (int)(p75 + MAPPING_BOUND * (p75 - p25) + .499);
+		if (r->low  > r->avg - MAX_STDDEV * r->std) r->low  = (int)(r->avg - MAX_STDDEV * r->std + .499);
+		if (r->high < r->avg + MAX_STDDEV * r->std) r->high = (int)(r->avg + MAX_STDDEV * r->std + .499);
+		if (r->low < 1) r->low = 1;
+	}
+	for (int d = 0; d < 4; ++d) {
+		if (pes[d].failed == 0 && acc->n[d] < max * MIN_DIR_RATIO)
+			pes[d].failed = 1;
+	}
+}
+
+static int _converged(const mem_pestat_t old[4], const mem_pestat_t new[4])
+{
+	for (int d = 0; d < 4; ++d) {
+		if (old[d].failed != new[d].failed)
+			return 0;
+		if (new[d].failed)
+			continue;
+		if (fabs(old[d].avg - new[d].avg) > PESTAT_TOLERANCE * new[d].avg
+				|| fabs(old[d].std - new[d].std) > PESTAT_TOLERANCE * new[d].std)
+			return 0;
+	}
+	return 1;
+}
+
+int rapi_bwa_pestat_update(pestat_acc* acc, const mem_opt_t* opt, int64_t l_pac, int n, const mem_alnreg_v* regs)
+{
+	if (acc->frozen)
+		return RAPI_NO_ERROR;
+
+	int error;
+	if (acc->max_ins != opt->max_ins && (error = _reset_histograms(acc, opt->max_ins)))
+		return error;
+
+	// the unique pairs, as selected by mem_pestat
+	uint64_t added = 0;
+	for (int i = 0; i < n >> 1; ++i) {
+		const mem_alnreg_v* r0 = &regs[i << 1 | 0];
+		const mem_alnreg_v* r1 = &regs[i << 1 | 1];
+		if (r0->n == 0 || r1->n == 0)
+			continue;
+		if (_cal_sub(opt, r0) > MIN_RATIO * r0->a[0].score) continue;
+		if (_cal_sub(opt, r1) > MIN_RATIO * r1->a[0].score) continue;
+		int64_t is;
+		const int dir = mem_infer_dir(l_pac, r0->a[0].rb, r1->a[0].rb, &is);
+		if (is && is <= opt->max_ins) {
+			acc->hist[dir][is] += 1;
+			acc->n[dir] += 1;
+			added += 1;
+		}
+	}
+	if (added == 0 && acc->has_estimate)
+		return RAPI_NO_ERROR;
+
+	const uint64_t total = acc->n[0] + acc->n[1] + acc->n[2] + acc->n[3];
+	if (acc->seeded && total < PESTAT_MIN_REPLACE)
+		return RAPI_NO_ERROR;
+
+	mem_pestat_t pes[4];
+	_estimate(acc, pes);
+	if (acc->has_estimate && !acc->seeded && total >= PESTAT_MIN_FREEZE && _converged(acc->pes, pes))
+		acc->frozen = 1;
+	memcpy(acc->pes, pes, sizeof(pes));
+	acc->has_estimate = 1;
+	acc->seeded = 0;
+	return RAPI_NO_ERROR;
+}
@@ -0,0 +1,49 @@
+/*
+ * rapi_pestat.h
+ *
+ * Insert-size statistics for the BWA plugin, accumulated across batches.
+ * Internal to the plugin:  not part of the RAPI interface.
+ */
+
+#ifndef __RAPI_PESTAT_H__
+#define __RAPI_PESTAT_H__
+
+#include <bwa.h>
+#include <bwamem.h>
+
+#include <stdint.h>
+
+/*
+ * A running histogram of the insert sizes of the unique pairs seen so far,
+ * for each orientation (FF, FR, RF, RR), and the estimate that mem_pestat
+ * would compute from it.  Once the estimate stops changing from one batch
+ * to the next it's frozen, and the histograms are no longer updated.
+ */
+typedef struct {
+	int max_ins;         // the histograms cover insert sizes 0..max_ins;  0 if not allocated
+	uint64_t* hist[4];
+	uint64_t n[4];       // pairs in each histogram
+	int has_estimate;    // pes is set, computed or seeded
+	int seeded;          // pes was set by rapi_bwa_pestat_seed
+	int frozen;
+	mem_pestat_t pes[4];
+} pestat_acc;
+
+void rapi_bwa_pestat_init(pestat_acc* acc);
+void rapi_bwa_pestat_free(pestat_acc* acc);
+
+/*
+ * Set the estimate from the known mean and standard deviation of the
+ * library's insert size, for the FR orientation only (as bwa mem -I).  If
+ * `freeze` is not set, the estimate computed from the data replaces it
+ * once there are enough pairs.
+ */
+void rapi_bwa_pestat_seed(pestat_acc* acc, double avg, double std, int freeze);
+
+/*
+ * Add the unique pairs in the n reads of `regs` (mates next to each
+ * other) and update the estimate.  Does nothing if the estimate is frozen.
+ */
+int rapi_bwa_pestat_update(pestat_acc* acc, const mem_opt_t* opt, int64_t l_pac, int n, const mem_alnreg_v* regs);
+
+#endif
@@ -0,0 +1,719 @@
+/*
+ * rapi_seed.c
+ *
+ * Interleaved SMEM search.
+ *
+ * Finding the SMEMs of a read is a chain of bwt_extend calls, each reading
+ * one or two occurrence blocks of the BWT at positions that depend on the
+ * result of the previous call.  With a large index nearly every one is a
+ * cache miss, so the search spends most of its time waiting for memory.
+ *
+ * Here the searches of SEED_GROUP_SIZE reads are advanced together, one
+ * extension at a time.  After each extension of a read the blocks that its
+ * next extension will read are prefetched, and the other reads are advanced
+ * before coming back to it:  by then the blocks have arrived.  A read that
+ * is done seeding is chained and extended right away, and its slot in the
+ * group is taken by the next read.
+ *
+ * The search is mem_collect_intv and bwt_smem1 from BWA 0.7.8 turned into a
+ * state machine, and finds the same SMEMs.  The chaining is BWA's mem_chain.
+ *
+ * The positions of the seeds with many occurrences are looked up in the
+ * sa_cache, if there is one.
+ *
+ * This file also has the exact-match fast path (rapi_bwa_exact_hit).
+ */
+
+#include "rapi_seed.h"
+
+#include <rapi.h>
+
+#include <kbtree.h>
+#include <kvec.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * From BWA's bwamem.c, which doesn't declare it in bwamem.h.
+ */
+extern int mem_sort_and_dedup(int n, mem_alnreg_t *a, float mask_level_redun);
+
+/* Where the current bwt_smem1 search is */
+enum {
+	SMEM_FORWARD,  // extending ik forward, at q[i]
+	SMEM_BACKWARD, // extending the intervals in prev backward, at q[i]
+	SMEM_DONE
+};
+
+/* Where mem_collect_intv is */
+enum {
+	COLLECT_SMEMS, // first pass:  finding the SMEMs
+	COLLECT_SPLIT, // second pass:  finding the MEMs within long SMEMs
+	COLLECT_DONE
+};
+
+typedef struct {
+	const mem_opt_t* opt;
+	const bwt_t* bwt;
+	int split_len;
+	sa_cache* sa_cache;
+	kvec_t(int64_t) positions; // scratch space for the cached positions
+} seed_ctx;
+
+typedef struct {
+	int read;         // index of the read in the batch, or -1 if the slot is free
+	int len;
+	const uint8_t* q;
+
+	// mem_collect_intv
+	int pass;
+	int k, old_n;     // second pass:  the SMEM being split
+	bwtintv_v mem;    // the SMEMs found so far
+
+	// bwt_smem1
+	int phase;
+	int start;        // where the search started
+	int i, j;
+	int min_intv;
+	int ret;          // where the next search starts
+	bwtintv_t ik;
+	bwtintv_v mem1;   // the SMEMs found by the search
+	bwtintv_v vec[2];
+	bwtintv_v *prev, *curr;
+
+	// the pending extension
+	const bwtintv_t* ext;
+	int is_back;
+} seed_iter;
+
+static inline void _prefetch_occ(const bwt_t* bwt, bwtint_t k)
+{
+	k -= (k >= bwt->primary); // as bwt_occ4 does
+	__builtin_prefetch(bwt_occ_intv(bwt, k));
+}
+
+/* Set the next extension of the search and prefetch the BWT blocks it reads */
+static inline void _set_ext(seed_iter* it, const bwt_t* bwt, const bwtintv_t* ik, int is_back)
+{
+	it->ext = ik;
+	it->is_back = is_back;
+	const bwtint_t k = ik->x[!is_back] - 1; // see bwt_extend
+	_prefetch_occ(bwt, k);
+	_prefetch_occ(bwt, k + ik->x[2]);
+}
+
+static void _reverse_intvs(bwtintv_v* p)
+{
+	for (size_t j = 0; j < p->n >> 1; ++j) {
+		bwtintv_t tmp = p->a[p->n - 1 - j];
+		p->a[p->n - 1 - j] = p->a[j];
+		p->a[j] = tmp;
+	}
+}
+
+static inline void _swap_intvs(seed_iter* it)
+{
+	bwtintv_v* swap = it->curr;
+	it->curr = it->prev;
+	it->prev = swap;
+}
+
+/* Keep interval p as an SMEM ending at i + 1, unless it's contained in a longer one */
+static inline void _smem_keep(seed_iter* it, const bwtintv_t* p)
+{
+	if (it->curr->n == 0) { // test curr->n>0 to make sure there are no longer matches
+		if (it->mem1.n == 0 || it->i + 1 < it->mem1.a[it->mem1.n - 1].info >> 32) { // skip contained matches
+			bwtintv_t ik = *p;
+			ik.info |= (uint64_t)(it->i + 1) << 32;
+			kv_push(bwtintv_t, it->mem1, ik);
+		}
+	}
+}
+
+/*
+ * Continue the backward search from it->i and it->j, up to the next
+ * extension or to the end of the search.
+ */
+static void _smem_backward(seed_iter* it, const bwt_t* bwt)
+{
+	while (1) {
+		const int c = it->i < 0 ? -1 : it->q[it->i] < 4 ? it->q[it->i] : -1; // c==-1 if i<0 or q[i] is an ambiguous base
+		if (it->j < it->prev->n) {
+			const bwtintv_t* p = &it->prev->a[it->j];
+			if (c >= 0) {
+				_set_ext(it, bwt, p, 1);
+				return;
+			}
+			// at the beginning or at an ambiguous base:  BWA extends p
+			// anyway, but then only keeps it
+			_smem_keep(it, p);
+			it->j += 1;
+			continue;
+		}
+		if (it->curr->n == 0) {
+			_reverse_intvs(&it->mem1); // s.t. sorted by the start coordinate
+			it->phase = SMEM_DONE;
+			return;
+		}
+		_swap_intvs(it);
+		it->i -= 1;
+		it->j = 0;
+		it->curr->n = 0;
+	}
+}
+
+static void _smem_backward_start(seed_iter* it, const bwt_t* bwt)
+{
+	_reverse_intvs(it->curr); // s.t. smaller intervals (i.e. longer matches) visited first
+	it->ret = it->curr->a[0].info;
+	_swap_intvs(it);
+	it->phase = SMEM_BACKWARD;
+	it->i = it->start - 1;
+	it->j = 0;
+	it->curr->n = 0;
+	_smem_backward(it, bwt);
+}
+
+/* Continue the forward search at it->i */
+static void _smem_forward(seed_iter* it, const bwt_t* bwt)
+{
+	if (it->i < it->len && it->q[it->i] < 4) {
+		_set_ext(it, bwt, &it->ik, 0);
+		return;
+	}
+	// always terminate extension at an ambiguous base or at the end
+	kv_push(bwtintv_t, *it->curr, it->ik);
+	_smem_backward_start(it, bwt);
+}
+
+/* Start the equivalent of bwt_smem1(bwt, len, q, x, min_intv, &it->mem1, it->vec) */
+static void _smem_start(seed_iter* it, const bwt_t* bwt, int x, int min_intv)
+{
+	it->mem1.n = 0;
+	if (it->q[x] > 3) {
+		it->ret = x + 1;
+		it->phase = SMEM_DONE;
+		return;
+	}
+	it->start = x;
+	it->min_intv = min_intv < 1 ? 1 : min_intv; // the interval size should be at least 1
+	it->prev = &it->vec[0];
+	it->curr = &it->vec[1];
+	it->curr->n = 0;
+	bwt_set_intv(bwt, it->q[x], it->ik); // the initial interval of a single base
+	it->ik.info = x + 1;
+	it->i = x + 1;
+	it->phase = SMEM_FORWARD;
+	_smem_forward(it, bwt);
+}
+
+/* Feed the result of the pending extension to the search */
+static void _smem_extended(seed_iter* it, const bwt_t* bwt, bwtintv_t ok[4])
+{
+	if (it->phase == SMEM_FORWARD) {
+		const int c = 3 - it->q[it->i]; // complement of q[i]
+		if (ok[c].x[2] != it->ik.x[2]) { // change of the interval size
+			kv_push(bwtintv_t, *it->curr, it->ik);
+			if (ok[c].x[2] < it->min_intv) { // the interval size is too small to be extended further
+				_smem_backward_start(it, bwt);
+				return;
+			}
+		}
+		it->ik = ok[c];
+		it->ik.info = it->i + 1;
+		it->i += 1;
+		_smem_forward(it, bwt);
+	}
+	else {
+		const bwtintv_t* p = it->ext;
+		const int c = it->q[it->i];
+		if (ok[c].x[2] < it->min_intv) // keep the hit if the intv is small enough
+			_smem_keep(it, p);
+		else if (it->curr->n == 0 || ok[c].x[2] != it->curr->a[it->curr->n - 1].x[2]) {
+			ok[c].info = p->info;
+			kv_push(bwtintv_t, *it->curr, ok[c]);
+		}
+		it->j += 1;
+		_smem_backward(it, bwt);
+	}
+}
+
+static int _intv_cmp(const void* a, const void* b)
+{
+	const uint64_t x = ((const bwtintv_t*)a)->info;
+	const uint64_t y = ((const bwtintv_t*)b)->info;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Collect the SMEMs found by the search that just finished and start the
+ * next one, until one needs an extension or all the SMEMs of the read have
+ * been found.
+ */
+static void _collect(seed_iter* it, const seed_ctx* ctx)
+{
+	while (it->phase == SMEM_DONE && it->pass != COLLECT_DONE) {
+		for (size_t i = 0; i < it->mem1.n; ++i) {
+			const bwtintv_t* p = &it->mem1.a[i];
+			const int slen = (uint32_t)p->info - (p->info >> 32); // seed length
+			if (slen >= ctx->opt->min_seed_len)
+				kv_push(bwtintv_t, it->mem, *p);
+		}
+		it->mem1.n = 0;
+
+		if (it->pass == COLLECT_SMEMS) {
+			int x = it->ret;
+			while (x < it->len && it->q[x] > 3)
+				++x;
+			if (x < it->len) {
+				_smem_start(it, ctx->bwt, x, 1);
+				continue;
+			}
+			it->pass = COLLECT_SPLIT;
+			it->k = -1;
+			it->old_n = it->mem.n;
+		}
+
+		// find the next long SMEM, with few occurrences, and look for the
+		// MEMs that cover its middle
+		while (++it->k < it->old_n) {
+			const bwtintv_t* p = &it->mem.a[it->k];
+			const int start = p->info >> 32, end = (int32_t)p->info;
+			if (end - start < ctx->split_len || p->x[2] > ctx->opt->split_width)
+				continue;
+			_smem_start(it, ctx->bwt, (start + end) >> 1, p->x[2] + 1);
+			break;
+		}
+		if (it->k >= it->old_n) {
+			if (it->mem.n > 1)
+				qsort(it->mem.a, it->mem.n, sizeof(bwtintv_t), _intv_cmp);
+			it->pass = COLLECT_DONE;
+		}
+	}
+}
+
+/* Start seeding a read */
+static void _seed_start(seed_iter* it, const seed_ctx* ctx, int read, const bseq1_t* seq)
+{
+	it->read = read;
+	it->len = seq->l_seq;
+	it->q = (const uint8_t*)seq->seq;
+	it->mem.n = 0;
+	it->mem1.n = 0;
+	if (it->len < ctx->opt->min_seed_len) { // if the query is shorter than the seed length, no match
+		it->pass = COLLECT_DONE;
+		return;
+	}
+	it->pass = COLLECT_SMEMS;
+	it->phase = SMEM_DONE;
+	it->ret = 0; // start the first search at 0
+	_collect(it, ctx);
+}
+
+/* Do the pending extension and advance the read to the next one */
+static inline void _seed_step(seed_iter* it, const seed_ctx* ctx)
+{
+	bwtintv_t ok[4];
+	bwt_extend(ctx->bwt, it->ext, ok, it->is_back);
+	_smem_extended(it, ctx->bwt, ok);
+	_collect(it, ctx);
+}
+
+/*
+ * test_and_merge from BWA 0.7.8's bwamem.c:  add seed p to chain c if it's
+ * compatible with it.
+ */
+static int _test_and_merge(const mem_opt_t* opt, int64_t l_pac, mem_chain_t* c, const mem_seed_t* p)
+{
+	int64_t qend, rend, x, y;
+	const mem_seed_t* last = &c->seeds[c->n - 1];
+	qend = last->qbeg + last->len;
+	rend = last->rbeg + last->len;
+	if (p->qbeg >= c->seeds[0].qbeg && p->qbeg + p->len <= qend && p->rbeg >= c->seeds[0].rbeg && p->rbeg + p->len <= rend)
+		return 1; // contained seed; do nothing
+	if ((last->rbeg < l_pac || c->seeds[0].rbeg < l_pac) && p->rbeg >= l_pac)
+		return 0; // don't chain if on different strand
+	x = p->qbeg - last->qbeg; // always non-negtive
+	y = p->rbeg - last->rbeg;
+	if (y >= 0 && x - y <= opt->w && y - x <= opt->w && x - last->len < opt->max_chain_gap && y - last->len < opt->max_chain_gap) { // grow the chain
+		if (c->n == c->m) {
+			c->m <<= 1;
+			c->seeds = realloc(c->seeds, c->m * sizeof(mem_seed_t));
+		}
+		c->seeds[c->n++] = *p;
+		return 1;
+	}
+	return 0; // request to add a new chain
+}
+
+/* The chains by position, as in bwamem.c */
+#define chain_cmp(a, b) (((b).pos < (a).pos) - ((a).pos < (b).pos))
+KBTREE_INIT(chn, mem_chain_t, chain_cmp)
+
+/******** SA interval cache *******/
+
+/* Intervals with fewer occurrences are cheaper to resolve than to cache */
+#define SA_CACHE_MIN_OCC 16
+/* Independently locked parts of the cache */
+#define SA_CACHE_SHARDS  64
+
+typedef struct sa_entry {
+	bwtint_t k;               // first row of the interval
+	bwtint_t n;               // its size
+	struct sa_entry* chain;   // next in the bucket
+	struct sa_entry* newer;   // LRU list
+	struct sa_entry* older;
+	int64_t pos[];            // bwt_sa(k), ..., bwt_sa(k + n - 1)
+} sa_entry;
+
+typedef struct {
+	pthread_mutex_t lock;
+	size_t capacity;
+	size_t bytes;
+	size_t n_entries;
+	size_t n_buckets;         // a power of 2
+	sa_entry** buckets;
+	sa_entry* newest;
+	sa_entry* oldest;
+} sa_shard;
+
+struct sa_cache {
+	sa_shard shards[SA_CACHE_SHARDS];
+};
+
+static inline uint64_t _sa_hash(bwtint_t k, bwtint_t n)
+{
+	uint64_t h = (k ^ (n << 40)) * 0x9e3779b97f4a7c15ULL;
+	return h ^ (h >> 32);
+}
+
+static inline size_t _sa_entry_size(bwtint_t n)
+{
+	return sizeof(sa_entry) + n * sizeof(int64_t);
+}
+
+int rapi_bwa_sa_cache_init(sa_cache** ret_cache, size_t capacity)
+{
+	sa_cache* cache = *ret_cache = calloc(1, sizeof(sa_cache));
+	if (NULL == cache)
+		return RAPI_MEMORY_ERROR;
+	for (int i = 0; i < SA_CACHE_SHARDS; ++i) {
+		pthread_mutex_init(&cache->shards[i].lock, NULL);
+		cache->shards[i].capacity = capacity / SA_CACHE_SHARDS;
+	}
+	return RAPI_NO_ERROR;
+}
+
+static void _sa_shard_remove(sa_shard* shard, sa_entry* e)
+{
+	sa_entry** p = &shard->buckets[_sa_hash(e->k, e->n) & (shard->n_buckets - 1)];
+	while (*p != e)
+		p = &(*p)->chain;
+	*p = e->chain;
+	if (e->newer) e->newer->older = e->older; else shard->newest = e->older;
+	if (e->older) e->older->newer = e->newer; else shard->oldest = e->newer;
+	shard->bytes -= _sa_entry_size(e->n);
+	shard->n_entries -= 1;
+	free(e);
+}
+
+void rapi_bwa_sa_cache_clear(sa_cache* cache)
+{
+	for (int i = 0; i < SA_CACHE_SHARDS; ++i) {
+		sa_shard* shard = &cache->shards[i];
+		pthread_mutex_lock(&shard->lock);
+		while (shard->oldest)
+			_sa_shard_remove(shard, shard->oldest);
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+void rapi_bwa_sa_cache_free(sa_cache* cache)
+{
+	if (NULL == cache)
+		return;
+	rapi_bwa_sa_cache_clear(cache);
+	for (int i = 0; i < SA_CACHE_SHARDS; ++i) {
+		pthread_mutex_destroy(&cache->shards[i].lock);
+		free(cache->shards[i].buckets);
+	}
+	free(cache);
+}
+
+static sa_entry* _sa_shard_find(const sa_shard* shard, bwtint_t k, bwtint_t n, uint64_t h)
+{
+	if (shard->n_buckets == 0)
+		return NULL;
+	for (sa_entry* e = shard->buckets[h & (shard->n_buckets - 1)]; e; e = e->chain) {
+		if (e->k == k && e->n == n)
+			return e;
+	}
+	return NULL;
+}
+
+static void _sa_shard_push_newest(sa_shard* shard, sa_entry* e)
+{
+	e->newer = NULL;
+	e->older = shard->newest;
+	if (shard->newest) shard->newest->newer = e; else shard->oldest = e;
+	shard->newest = e;
+}
+
+/* Keep the number of buckets at least the number of entries */
+static void _sa_shard_grow(sa_shard* shard)
+{
+	if (shard->n_entries < shard->n_buckets)
+		return;
+	const size_t n_buckets = shard->n_buckets ? 2 * shard->n_buckets : 64;
+	sa_entry** buckets = calloc(n_buckets, sizeof(sa_entry*));
+	if (NULL == buckets)
+		return; // the chains just get longer
+	for (size_t b = 0; b < shard->n_buckets; ++b) {
+		for (sa_entry* e = shard->buckets[b], *next; e; e = next) {
+			next = e->chain;
+			e->chain = buckets[_sa_hash(e->k, e->n) & (n_buckets - 1)];
+			buckets[_sa_hash(e->k, e->n) & (n_buckets - 1)] = e;
+		}
+	}
+	free(shard->buckets);
+	shard->buckets = buckets;
+	shard->n_buckets = n_buckets;
+}
+
+/*
+ * The positions of the occurrences of interval p, in ctx->positions.  On
+ * a miss they're resolved outside the lock, then added to the cache.
+ */
+static const int64_t* _sa_positions(seed_ctx* ctx, const bwtintv_t* p)
+{
+	const bwtint_t k = p->x[0], n = p->x[2];
+	const uint64_t h = _sa_hash(k, n);
+	sa_shard* shard = &ctx->sa_cache->shards[(h >> 16) % SA_CACHE_SHARDS];
+
+	if (n > ctx->positions.m)
+		kv_resize(int64_t, ctx->positions, n);
+	pthread_mutex_lock(&shard->lock);
+	sa_entry* e = _sa_shard_find(shard, k, n, h);
+	if (e) {
+		memcpy(ctx->positions.a, e->pos, n * sizeof(int64_t));
+		if (e != shard->newest) {
+			e->newer->older = e->older;
+			if (e->older) e->older->newer = e->newer; else shard->oldest = e->newer;
+			_sa_shard_push_newest(shard, e);
+		}
+	}
+	pthread_mutex_unlock(&shard->lock);
+	if (e)
+		return ctx->positions.a;
+
+	for (bwtint_t i = 0; i < n; ++i)
+		ctx->positions.a[i] = bwt_sa(ctx->bwt, k + i);
+
+	const size_t size = _sa_entry_size(n);
+	if (size > shard->capacity || NULL == (e = malloc(size)))
+		return ctx->positions.a;
+	e->k = k;
+	e->n = n;
+	memcpy(e->pos, ctx->positions.a, n * sizeof(int64_t));
+
+	pthread_mutex_lock(&shard->lock);
+	if (_sa_shard_find(shard, k, n, h)) { // added by another thread meanwhile
+		pthread_mutex_unlock(&shard->lock);
+		free(e);
+		return ctx->positions.a;
+	}
+	_sa_shard_grow(shard);
+	if (shard->n_buckets == 0) {
+		pthread_mutex_unlock(&shard->lock);
+		free(e);
+		return ctx->positions.a;
+	}
+	sa_entry** bucket = &shard->buckets[h & (shard->n_buckets - 1)];
+	e->chain = *bucket;
+	*bucket = e;
+	_sa_shard_push_newest(shard, e);
+	shard->bytes += size;
+	shard->n_entries += 1;
+	while (shard->bytes > shard->capacity)
+		_sa_shard_remove(shard, shard->oldest);
+	pthread_mutex_unlock(&shard->lock);
+	return ctx->positions.a;
+}
+
+/* mem_chain from BWA 0.7.8, on the SMEMs found by _collect */
+static mem_chain_v _chain_seeds(seed_ctx* ctx, int64_t l_pac, const bwtintv_v* mems)
+{
+	const mem_opt_t* opt = ctx->opt;
+	mem_chain_v chain;
+	kv_init(chain);
+	kbtree_t(chn)* tree = kb_init(chn, KB_DEFAULT_SIZE);
+
+	for (size_t i = 0; i < mems->n; ++i) {
+		const bwtintv_t* p = &mems->a[i];
+		const int slen = (uint32_t)p->info - (p->info >> 32); // seed length
+		if (slen < opt->min_seed_len || p->x[2] > opt->max_occ)
+			continue; // ignore if too short or too repetitive
+		const int64_t* pos = ctx->sa_cache && p->x[2] >= SA_CACHE_MIN_OCC ? _sa_positions(ctx, p) : NULL;
+		for (bwtint_t k = 0; k < p->x[2]; ++k) {
+			mem_chain_t tmp, *lower, *upper;
+			mem_seed_t s;
+			s.rbeg = tmp.pos = pos ? pos[k] : bwt_sa(ctx->bwt, p->x[0] + k); // this is the base coordinate in the forward-reverse reference
+			s.qbeg = p->info >> 32;
+			s.len = slen;
+			if (s.rbeg < l_pac && l_pac < s.rbeg + s.len)
+				continue; // bridging forward-reverse boundary; skip
+			if (kb_size(tree)) {
+				kb_intervalp(chn, tree, &tmp, &lower, &upper); // find the closest chain
+				if (lower && _test_and_merge(opt, l_pac, lower, &s))
+					continue;
+			}
+			// add the seed as a new chain
+			tmp.n = 1;
+			tmp.m = 4;
+			tmp.seeds = calloc(tmp.m, sizeof(mem_seed_t));
+			tmp.seeds[0] = s;
+			kb_putp(chn, tree, &tmp);
+		}
+	}
+
+	kv_resize(mem_chain_t, chain, kb_size(tree));
+#define traverse_func(p_) (chain.a[chain.n++] = *(p_))
+	__kb_traverse(mem_chain_t, tree, traverse_func);
+#undef traverse_func
+	kb_destroy(chn, tree);
+	return chain;
+}
+
+/* The rest of mem_align1_core, once the read's SMEMs have been found */
+static mem_alnreg_v _extend_seeds(seed_ctx* ctx, const bwaidx_t* idx, const seed_iter* it)
+{
+	const int64_t l_pac = idx->bns->l_pac;
+	mem_chain_v chn = _chain_seeds(ctx, l_pac, &it->mem);
+	chn.n = mem_chain_flt(ctx->opt, chn.n, chn.a);
+
+	mem_alnreg_v regs;
+	kv_init(regs);
+	for (size_t i = 0; i < chn.n; ++i) {
+		mem_chain2aln(ctx->opt, l_pac, idx->pac, it->len, it->q, &chn.a[i], &regs);
+		free(chn.a[i].seeds);
+	}
+	free(chn.a);
+	regs.n = mem_sort_and_dedup(regs.n, regs.a, ctx->opt->mask_level_redun);
+	return regs;
+}
+
+/*
+ * Finish the reads in the slot that are done seeding, starting the next
+ * ones.  Return 0 when there are no more reads for the slot.
+ */
+static int _refill_slot(seed_ctx* ctx, const bwaidx_t* idx, seed_iter* it,
+		int* next, int n, const bseq1_t* seqs, mem_alnreg_v* regs, const uint8_t* skip)
+{
+	while (it->read < 0 || it->pass == COLLECT_DONE) {
+		if (it->read >= 0)
+			regs[it->read] = _extend_seeds(ctx, idx, it);
+		while (skip && *next < n && skip[*next])
+			*next += 1;
+		if (*next >= n) {
+			it->read = -1;
+			return 0;
+		}
+		const int read = (*next)++;
+		_seed_start(it, ctx, read, &seqs[read]);
+	}
+	return 1;
+}
+
+void rapi_bwa_align_core(const mem_opt_t* opt, const bwaidx_t* idx, int n, const bseq1_t* seqs, mem_alnreg_v* regs,
+		const uint8_t* skip, sa_cache* cache)
+{
+	seed_ctx ctx;
+	ctx.opt = opt;
+	ctx.bwt = idx->bwt;
+	ctx.split_len = (int)(opt->min_seed_len * opt->split_factor + .499);
+	ctx.sa_cache = cache;
+	kv_init(ctx.positions);
+
+	seed_iter slots[SEED_GROUP_SIZE];
+	memset(slots, 0, sizeof(slots));
+
+	int next = 0;
+	int n_active = 0;
+	for (int s = 0; s < SEED_GROUP_SIZE; ++s) {
+		slots[s].read = -1;
+		n_active += _refill_slot(&ctx, idx, &slots[s], &next, n, seqs, regs, skip);
+	}
+
+	while (n_active > 0) {
+		for (int s = 0; s < SEED_GROUP_SIZE; ++s) {
+			seed_iter* it = &slots[s];
+			if (it->read < 0)
+				continue;
+			_seed_step(it, &ctx);
+			if (it->pass == COLLECT_DONE && !_refill_slot(&ctx, idx, it, &next, n, seqs, regs, skip))
+				n_active -= 1;
+		}
+	}
+
+	for (int s = 0; s < SEED_GROUP_SIZE; ++s) {
+		kv_destroy(slots[s].mem);
+		kv_destroy(slots[s].mem1);
+		kv_destroy(slots[s].vec[0]);
+		kv_destroy(slots[s].vec[1]);
+	}
+	kv_destroy(ctx.positions);
+}
+
+/******** Exact-match fast path *******/
+
+/*
+ * A backward search of the whole read on the FM-index tells whether it
+ * occurs exactly once in the forward-reverse reference.  Mismatches
+ * usually empty the interval within a few bases of them, so reads that
+ * don't match exactly only cost a short search.
+ */
+int rapi_bwa_exact_hit(const mem_opt_t* opt, const bwaidx_t* idx, const bseq1_t* seq, mem_alnreg_t* reg)
+{
+	const bwt_t* bwt = idx->bwt;
+	const bntseq_t* bns = idx->bns;
+	const uint8_t* q = (const uint8_t*)seq->seq;
+	const int len = seq->l_seq;
+
+	// too short for BWA to report an alignment
+	if (len < opt->min_seed_len || len * opt->a < opt->T || q[len - 1] > 3)
+		return 0;
+
+	bwtintv_t ik, ok[4];
+	bwt_set_intv(bwt, q[len - 1], ik);
+	for (int i = len - 2; i >= 0 && ik.x[2] > 0; --i) {
+		if (q[i] > 3)
+			return 0;
+		bwt_extend(bwt, &ik, ok, 1);
+		ik = ok[q[i]];
+	}
+	if (ik.x[2] != 1)
+		return 0;
+
+	const int64_t rb = bwt_sa(bwt, ik.x[0]);
+	if (rb < bns->l_pac && bns->l_pac < rb + len)
+		return 0; // bridging the forward-reverse boundary
+	int is_rev;
+	const int64_t pos = bns_depos(bns, rb < bns->l_pac ? rb : rb + len - 1, &is_rev);
+	if (bns_pos2rid(bns, pos) != bns_pos2rid(bns, pos + len - 1))
+		return 0; // across two contigs
+	if (bns_cnt_ambi(bns, pos, len, NULL) > 0)
+		return 0; // matches bases that are random in the pac
+
+	memset(reg, 0, sizeof(*reg));
+	reg->rb = rb;
+	reg->re = rb + len;
+	reg->qb = 0;
+	reg->qe = len;
+	reg->score = reg->truesc = len * opt->a;
+	reg->seedcov = len;
+	reg->secondary = -1;
+	return 1;
+}
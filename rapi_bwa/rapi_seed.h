@@ -0,0 +1,51 @@
+/*
+ * rapi_seed.h
+ *
+ * Seeding and extension of batches of reads for the BWA plugin.  Internal
+ * to the plugin:  not part of the RAPI interface.
+ */
+
+#ifndef __RAPI_SEED_H__
+#define __RAPI_SEED_H__
+
+#include <bwa.h>
+#include <bwamem.h>
+
+/* Number of reads whose SMEM searches are advanced together */
+#define SEED_GROUP_SIZE 16
+
+/*
+ * A cache of the reference positions of the SA intervals of repetitive
+ * seeds, which otherwise cost one bwt_sa call per occurrence for every
+ * read they're found in.  It's thread-safe and its memory is bounded
+ * (least recently used intervals are evicted).  The cached positions are
+ * those of one index:  clear the cache before using it with another.
+ */
+typedef struct sa_cache sa_cache;
+
+int rapi_bwa_sa_cache_init(sa_cache** ret_cache, size_t capacity);
+void rapi_bwa_sa_cache_clear(sa_cache* cache);
+void rapi_bwa_sa_cache_free(sa_cache* cache);
+
+/*
+ * Find the alignment regions of the n reads in `seqs`, storing them in
+ * `regs`.  The result is the same as calling BWA's mem_align1_core on each
+ * read, but the SMEM searches of SEED_GROUP_SIZE reads at a time are
+ * interleaved to hide the latency of the BWT lookups (see rapi_seed.c).
+ * Reads with skip[i] set are left alone (skip may be NULL).  `cache` may
+ * be NULL.
+ *
+ * The sequences must already be in 2-bit encoding (0-3, 4 for N).
+ */
+void rapi_bwa_align_core(const mem_opt_t* opt, const bwaidx_t* idx, int n, const bseq1_t* seqs, mem_alnreg_v* regs,
+		const uint8_t* skip, sa_cache* cache);
+
+/*
+ * The exact-match fast path.  If the whole read occurs exactly once in the
+ * reference (on either strand, within a contig and away from ambiguous
+ * bases), set `reg` to the region BWA would find for it and return 1.
+ * Otherwise return 0.
+ */
+int rapi_bwa_exact_hit(const mem_opt_t* opt, const bwaidx_t* idx, const bseq1_t* seq, mem_alnreg_t* reg);
+
+#endif